@@ -54,6 +54,9 @@
 #define CHUNK_SIZE_LEN          2
 #define CHUNK_SIZE_MASK         0x3FFF
 
+/* payloads up to this size are sealed by aead_chunk_seal_small() */
+#define SMALL_CHUNK_SIZE        128
+
 /*
  * Designed by wongsyrone with help from breakwa11 and Noisyfox
  * Session key is only applied to TCP, UDP keeps using master key.
@@ -186,45 +189,53 @@ static const int supported_aead_ciphers_tag_size[AEAD_CIPHER_NUM] = {
     16, 16, 16, 16, 16, 16
 };
 
+/*
+ * Seal m into c and write the tag to tag. c may equal m, and tag may sit
+ * anywhere, which lets a chunk be sealed in place with its tag kept apart.
+ */
 static int
-aead_cipher_encrypt(cipher_ctx_t *cipher_ctx,
-                    uint8_t *c,
-                    size_t *clen,
-                    uint8_t *m,
-                    size_t mlen,
-                    uint8_t *ad,
-                    size_t adlen,
-                    uint8_t *n,
-                    uint8_t *k)
+aead_cipher_encrypt_detached(cipher_ctx_t *cipher_ctx,
+                             uint8_t *c,
+                             uint8_t *tag,
+                             uint8_t *m,
+                             size_t mlen,
+                             uint8_t *ad,
+                             size_t adlen,
+                             uint8_t *n,
+                             uint8_t *k)
 {
     int err                      = CRYPTO_OK;
-    unsigned long long long_clen = 0;
+    unsigned long long long_tlen = 0;
+    size_t olen                  = 0;
 
     size_t nlen = cipher_ctx->cipher->nonce_len;
     size_t tlen = cipher_ctx->cipher->tag_len;
 
     switch (cipher_ctx->cipher->method) {
+    case AES256GCM:
+        if (cipher_ctx->aes_gcm != NULL) {
+            err = crypto_aead_aes256gcm_encrypt_detached_afternm(c, tag, &long_tlen, m, mlen,
+                                                                 ad, adlen, NULL, n,
+                                                                 cipher_ctx->aes_gcm);
+            break;
+        }
+    // fall through
     case AES128GCM:
     case AES192GCM:
-    case AES256GCM:
         err = mbedtls_cipher_auth_encrypt(cipher_ctx->evp, n, nlen, ad, adlen,
-                                          m, mlen, c, clen, c + mlen, tlen);
-        *clen += tlen;
+                                          m, mlen, c, &olen, tag, tlen);
         break;
     case CHACHA20POLY1305:
-        err = crypto_aead_chacha20poly1305_encrypt(c, &long_clen, m, mlen,
-                                                   ad, adlen, NULL, n, k);
-        *clen = (size_t)long_clen;
+        err = crypto_aead_chacha20poly1305_encrypt_detached(c, tag, &long_tlen, m, mlen,
+                                                            ad, adlen, NULL, n, k);
         break;
     case CHACHA20POLY1305IETF:
-        err = crypto_aead_chacha20poly1305_ietf_encrypt(c, &long_clen, m, mlen,
-                                                        ad, adlen, NULL, n, k);
-        *clen = (size_t)long_clen;
+        err = crypto_aead_chacha20poly1305_ietf_encrypt_detached(c, tag, &long_tlen, m, mlen,
+                                                                 ad, adlen, NULL, n, k);
         break;
     case XCHACHA20POLY1305IETF:
-        err = crypto_aead_xchacha20poly1305_ietf_encrypt(c, &long_clen, m, mlen,
-                                                         ad, adlen, NULL, n, k);
-        *clen = (size_t)long_clen;
+        err = crypto_aead_xchacha20poly1305_ietf_encrypt_detached(c, tag, &long_tlen, m, mlen,
+                                                                  ad, adlen, NULL, n, k);
         break;
     default:
         return CRYPTO_ERROR;
@@ -233,6 +244,25 @@ aead_cipher_encrypt(cipher_ctx_t *cipher_ctx,
     return err;
 }
 
+static int
+aead_cipher_encrypt(cipher_ctx_t *cipher_ctx,
+                    uint8_t *c,
+                    size_t *clen,
+                    uint8_t *m,
+                    size_t mlen,
+                    uint8_t *ad,
+                    size_t adlen,
+                    uint8_t *n,
+                    uint8_t *k)
+{
+    int err = aead_cipher_encrypt_detached(cipher_ctx, c, c + mlen, m, mlen,
+                                           ad, adlen, n, k);
+
+    *clen = mlen + cipher_ctx->cipher->tag_len;
+
+    return err;
+}
+
 static int
 aead_cipher_decrypt(cipher_ctx_t *cipher_ctx,
                     uint8_t *p,
@@ -251,9 +281,16 @@ aead_cipher_decrypt(cipher_ctx_t *cipher_ctx,
     size_t tlen = cipher_ctx->cipher->tag_len;
 
     switch (cipher_ctx->cipher->method) {
+    case AES256GCM:
+        if (cipher_ctx->aes_gcm != NULL) {
+            err = crypto_aead_aes256gcm_decrypt_afternm(p, &long_plen, NULL, m, mlen,
+                                                        ad, adlen, n, cipher_ctx->aes_gcm);
+            *plen = (size_t)long_plen;
+            break;
+        }
+    // fall through
     case AES128GCM:
     case AES192GCM:
-    case AES256GCM:
         err = mbedtls_cipher_auth_decrypt(cipher_ctx->evp, n, nlen, ad, adlen,
                                           m, mlen - tlen, p, plen, m + mlen - tlen, tlen);
         break;
@@ -301,6 +338,35 @@ aead_derive_key(const char *pass, uint8_t *key, size_t key_len)
     }
 }
 
+/*
+ * Expands an AES-256 key for AES-NI and PCLMUL through libsodium, once for
+ * all the chunks of a session instead of going through the mbed TLS cipher
+ * layer for every one of them. libsodium wants the state 16 byte aligned.
+ * Aborts if the aligned memory cannot be allocated. Returns NULL only when
+ * built without posix_memalign(), mbed TLS is used for AES-256-GCM then.
+ */
+static crypto_aead_aes256gcm_state *
+aead_aes_gcm_new(const uint8_t *key)
+{
+    void *state = NULL;
+
+#ifdef HAVE_POSIX_MEMALIGN
+    if (posix_memalign(&state, 16, sizeof(crypto_aead_aes256gcm_state)) != 0) {
+        FATAL("Cannot allocate AES-GCM state");
+    }
+    crypto_aead_aes256gcm_beforenm(state, key);
+#endif
+
+    return state;
+}
+
+static void
+aead_aes_gcm_free(crypto_aead_aes256gcm_state *state)
+{
+    sodium_memzero(state, sizeof(crypto_aead_aes256gcm_state));
+    free(state);
+}
+
 static void
 aead_cipher_ctx_set_subkey(cipher_ctx_t *cipher_ctx, int enc)
 {
@@ -325,6 +391,12 @@ aead_cipher_ctx_set_subkey(cipher_ctx_t *cipher_ctx, int enc)
     if (method >= CHACHA20POLY1305) {
         // no need to set key for libsodium, just return
         return;
+    } else if (cipher_ctx->cipher->aes_gcm != NULL) {
+        if (cipher_ctx->aes_gcm == NULL) {
+            cipher_ctx->aes_gcm = aead_aes_gcm_new(cipher_ctx->subkey);
+        } else {
+            crypto_aead_aes256gcm_beforenm(cipher_ctx->aes_gcm, cipher_ctx->subkey);
+        }
     } else {
         if (mbedtls_cipher_setkey(cipher_ctx->evp, cipher_ctx->subkey,
                                   cipher_ctx->cipher->key_len * 8, enc) != 0) {
@@ -347,6 +419,12 @@ aead_cipher_ctx_udp_set_key(cipher_ctx_t *cipher_ctx, int enc)
     if (cipher_ctx->cipher->method >= CHACHA20POLY1305)
         return;
 
+    /* the master key is expanded once, share it */
+    if (cipher_ctx->cipher->aes_gcm != NULL) {
+        cipher_ctx->aes_gcm = cipher_ctx->cipher->aes_gcm;
+        return;
+    }
+
     if (mbedtls_cipher_setkey(cipher_ctx->evp, cipher_ctx->cipher->key,
                               cipher_ctx->cipher->key_len * 8, enc) != 0) {
         FATAL("[udp] Cannot set mbed TLS cipher master key");
@@ -395,6 +473,11 @@ aead_cipher_ctx_init(cipher_ctx_t *cipher_ctx, int method, int enc)
         return;
     }
 
+    /* no mbed TLS context when libsodium does AES-GCM */
+    if (cipher_ctx->cipher->aes_gcm != NULL) {
+        return;
+    }
+
     const char *ciphername = supported_aead_ciphers[method];
 
     const cipher_kt_t *cipher = aead_get_cipher_type(method);
@@ -443,8 +526,17 @@ aead_ctx_release(cipher_ctx_t *cipher_ctx)
         return;
     }
 
-    mbedtls_cipher_free(cipher_ctx->evp);
-    ss_free(cipher_ctx->evp);
+    if (cipher_ctx->aes_gcm != NULL) {
+        if (cipher_ctx->aes_gcm != cipher_ctx->cipher->aes_gcm) {
+            aead_aes_gcm_free(cipher_ctx->aes_gcm);
+        }
+        cipher_ctx->aes_gcm = NULL;
+    }
+
+    if (cipher_ctx->evp != NULL) {
+        mbedtls_cipher_free(cipher_ctx->evp);
+        ss_free(cipher_ctx->evp);
+    }
 }
 
 int
@@ -457,21 +549,21 @@ aead_encrypt_all(buffer_t *plaintext, cipher_t *cipher, size_t capacity)
     size_t tag_len  = cipher->tag_len;
     int err         = CRYPTO_OK;
 
-    static buffer_t tmp = { 0, 0, 0, NULL };
-    brealloc(&tmp, salt_len + tag_len + plaintext->len, capacity);
-    buffer_t *ciphertext = &tmp;
-    ciphertext->len = tag_len + plaintext->len;
+    /* make room for the salt and seal the packet in place */
+    brealloc(plaintext, salt_len + plaintext->len + tag_len, capacity);
+    memmove(plaintext->data + salt_len, plaintext->data, plaintext->len);
 
     /* copy salt to first pos */
-    memcpy(ciphertext->data, cipher_ctx.salt, salt_len);
+    memcpy(plaintext->data, cipher_ctx.salt, salt_len);
 
     aead_cipher_ctx_udp_set_key(&cipher_ctx, 1);
 
-    size_t clen = ciphertext->len;
+    uint8_t *data = (uint8_t *)plaintext->data + salt_len;
+    size_t clen   = plaintext->len + tag_len;
     err = aead_cipher_encrypt(&cipher_ctx,
-                              (uint8_t *)ciphertext->data + salt_len,
+                              data,
                               &clen,
-                              (uint8_t *)plaintext->data,
+                              data,
                               plaintext->len,
                               NULL,
                               0,
@@ -483,16 +575,13 @@ aead_encrypt_all(buffer_t *plaintext, cipher_t *cipher, size_t capacity)
     if (err)
         return CRYPTO_ERROR;
 
-#ifdef FS_DEBUG
-    dump("PLAIN", plaintext->data, plaintext->len);
-    dump("CIPHER", ciphertext->data + salt_len, ciphertext->len);
-#endif
+    assert(clen == plaintext->len + tag_len);
 
-    assert(ciphertext->len == clen);
+    plaintext->len = salt_len + clen;
 
-    brealloc(plaintext, salt_len + ciphertext->len, capacity);
-    memcpy(plaintext->data, ciphertext->data, salt_len + ciphertext->len);
-    plaintext->len = salt_len + ciphertext->len;
+#ifdef FS_DEBUG
+    dump("CIPHER", plaintext->data + salt_len, clen);
+#endif
 
     return CRYPTO_OK;
 }
@@ -511,11 +600,6 @@ aead_decrypt_all(buffer_t *ciphertext, cipher_t *cipher, size_t capacity)
     cipher_ctx_t cipher_ctx;
     aead_ctx_init(cipher, &cipher_ctx, 0);
 
-    static buffer_t tmp = { 0, 0, 0, NULL };
-    brealloc(&tmp, ciphertext->len, capacity);
-    buffer_t *plaintext = &tmp;
-    plaintext->len = ciphertext->len - salt_len - tag_len;
-
     /* get salt */
     uint8_t *salt = cipher_ctx.salt;
     memcpy(salt, ciphertext->data, salt_len);
@@ -532,22 +616,23 @@ aead_decrypt_all(buffer_t *ciphertext, cipher_t *cipher, size_t capacity)
 
     aead_cipher_ctx_udp_set_key(&cipher_ctx, 0);
 
-    size_t plen = plaintext->len;
+#ifdef FS_DEBUG
+    dump("CIPHER", ciphertext->data + salt_len, ciphertext->len - salt_len);
+#endif
+
+    /* open the packet in place, right behind the salt */
+    uint8_t *data = (uint8_t *)ciphertext->data + salt_len;
+    size_t plen   = ciphertext->len - salt_len - tag_len;
     err = aead_cipher_decrypt(&cipher_ctx,
-                              (uint8_t *)plaintext->data,
+                              data,
                               &plen,
-                              (uint8_t *)ciphertext->data + salt_len,
+                              data,
                               ciphertext->len - salt_len,
                               NULL,
                               0,
                               cipher_ctx.nonce,
                               cipher_ctx.cipher->key);
 
-#ifdef FS_DEBUG
-    dump("PLAIN", plaintext->data, plaintext->len);
-    dump("CIPHER", ciphertext->data + salt_len, ciphertext->len - salt_len);
-#endif
-
     aead_ctx_release(&cipher_ctx);
 
     if (err)
@@ -558,52 +643,152 @@ aead_decrypt_all(buffer_t *ciphertext, cipher_t *cipher, size_t capacity)
         LOGE("[udp] crypto: AEAD: failed to add salt");
 #endif
 
-    brealloc(ciphertext, plaintext->len, capacity);
-    memcpy(ciphertext->data, plaintext->data, plaintext->len);
-    ciphertext->len = plaintext->len;
+    memmove(ciphertext->data, data, plen);
+    ciphertext->len = plen;
+
+#ifdef FS_DEBUG
+    dump("PLAIN", ciphertext->data, ciphertext->len);
+#endif
 
     return CRYPTO_OK;
 }
 
+static inline void
+store64_le(uint8_t *p, uint64_t v)
+{
+    int i;
+    for (i = 0; i < 8; i++)
+        p[i] = (uint8_t)(v >> (8 * i));
+}
+
+/*
+ * Seal a chunk of up to SMALL_CHUNK_SIZE bytes with one of the ChaCha20-
+ * Poly1305 ciphers. The length and the payload need a nonce each, that is
+ * what the protocol says, but for each of them a single keystream call
+ * yields both the one time Poly1305 key (block 0) and the bytes that
+ * encrypt the data (from block 1), and the tag is computed in one go over
+ * the ciphertext laid out in the same scratch buffer with its padding and
+ * lengths. libsodium's AEAD functions make two keystream calls and feed
+ * Poly1305 piece by piece, which costs more than the data itself for the
+ * few bytes of keystrokes or small frames. The output is the same.
+ */
 static int
-aead_chunk_encrypt(cipher_ctx_t *ctx, uint8_t *p, uint8_t *c, uint8_t *n,
-                   uint16_t plen)
+aead_chunk_seal_small(cipher_ctx_t *ctx, uint8_t *hdr, uint8_t *p, uint8_t *c,
+                      uint8_t *tag, uint8_t *n, uint16_t plen)
+{
+    int method  = ctx->cipher->method;
+    size_t nlen = ctx->cipher->nonce_len;
+    uint8_t len_buf[CHUNK_SIZE_LEN];
+    uint8_t buf[64 + SMALL_CHUNK_SIZE + 32];
+    uint8_t otk[crypto_onetimeauth_poly1305_KEYBYTES];
+    uint8_t subkey[crypto_core_hchacha20_OUTPUTBYTES];
+    uint8_t nonce[12];
+    int i, err = 0;
+
+    uint16_t t = htons(plen);
+    memcpy(len_buf, &t, CHUNK_SIZE_LEN);
+
+    // the length first, then the payload, each with the next nonce
+    for (i = 0; i < 2; i++) {
+        const uint8_t *m = i == 0 ? len_buf : p;
+        uint8_t *out     = i == 0 ? hdr : c;
+        uint8_t *mac     = i == 0 ? hdr + CHUNK_SIZE_LEN : tag;
+        size_t mlen      = i == 0 ? CHUNK_SIZE_LEN : plen;
+        size_t padded    = (mlen + 15) & ~(size_t)15;
+
+        // zeros to be turned into the key, the data, zeros for the tag
+        memset(buf, 0, 64);
+        memcpy(buf + 64, m, mlen);
+        memset(buf + 64 + mlen, 0, padded - mlen + 16);
+
+        if (method == CHACHA20POLY1305) {
+            // the original construction: le64(adlen) || c || le64(clen)
+            err |= crypto_stream_chacha20_xor_ic(buf, buf, 64 + mlen, n, 0, ctx->subkey);
+            memcpy(otk, buf, sizeof(otk));
+            memset(buf + 56, 0, 8);
+            store64_le(buf + 64 + mlen, mlen);
+            err |= crypto_onetimeauth_poly1305(mac, buf + 56, 8 + mlen + 8, otk);
+        } else {
+            const uint8_t *k  = ctx->subkey;
+            const uint8_t *iv = n;
+            if (method == XCHACHA20POLY1305IETF) {
+                crypto_core_hchacha20(subkey, n, ctx->subkey, NULL);
+                memset(nonce, 0, 4);
+                memcpy(nonce + 4, n + 16, 8);
+                k  = subkey;
+                iv = nonce;
+            }
+            // RFC 8439: c || pad16 || le64(adlen) || le64(clen)
+            err |= crypto_stream_chacha20_ietf_xor_ic(buf, buf, 64 + mlen, iv, 0, k);
+            memcpy(otk, buf, sizeof(otk));
+            store64_le(buf + 64 + padded + 8, mlen);
+            err |= crypto_onetimeauth_poly1305(mac, buf + 64, padded + 16, otk);
+        }
+
+        memcpy(out, buf + 64, mlen);
+        sodium_increment(n, nlen);
+    }
+
+    sodium_memzero(buf, sizeof(buf));
+    sodium_memzero(otk, sizeof(otk));
+    sodium_memzero(subkey, sizeof(subkey));
+
+    return err ? CRYPTO_ERROR : CRYPTO_OK;
+}
+
+/*
+ * Seal one chunk: the encrypted length and its tag go to hdr, the payload
+ * is sealed from p into c and its tag goes to tag. Any of them may alias,
+ * p == c seals the payload in place.
+ */
+static int
+aead_chunk_seal(cipher_ctx_t *ctx, uint8_t *hdr, uint8_t *p, uint8_t *c,
+                uint8_t *tag, uint8_t *n, uint16_t plen)
 {
     size_t nlen = ctx->cipher->nonce_len;
-    size_t tlen = ctx->cipher->tag_len;
 
     assert(plen <= CHUNK_SIZE_MASK);
 
     int err;
-    size_t clen;
     uint8_t len_buf[CHUNK_SIZE_LEN];
     uint16_t real_plen = min(plen, CHUNK_SIZE_MASK);
-    uint16_t t         = htons(real_plen);
+
+    if (ctx->cipher->method >= CHACHA20POLY1305 && real_plen <= SMALL_CHUNK_SIZE)
+        return aead_chunk_seal_small(ctx, hdr, p, c, tag, n, real_plen);
+
+    uint16_t t = htons(real_plen);
     memcpy(len_buf, &t, CHUNK_SIZE_LEN);
 
-    clen = CHUNK_SIZE_LEN + tlen;
-    err  = aead_cipher_encrypt(ctx, c, &clen, len_buf, CHUNK_SIZE_LEN,
-                               NULL, 0, n, ctx->subkey);
+    err = aead_cipher_encrypt_detached(ctx, hdr, hdr + CHUNK_SIZE_LEN, len_buf,
+                                       CHUNK_SIZE_LEN, NULL, 0, n, ctx->subkey);
     if (err)
         return CRYPTO_ERROR;
 
-    assert(clen == CHUNK_SIZE_LEN + tlen);
-
     sodium_increment(n, nlen);
 
-    clen = real_plen + tlen;
-    err  = aead_cipher_encrypt(ctx, c + CHUNK_SIZE_LEN + tlen, &clen, p, real_plen,
-                               NULL, 0, n, ctx->subkey);
+    err = aead_cipher_encrypt_detached(ctx, c, tag, p, real_plen,
+                                       NULL, 0, n, ctx->subkey);
     if (err)
         return CRYPTO_ERROR;
 
-    assert(clen == real_plen + tlen);
-
     sodium_increment(n, nlen);
 
     return CRYPTO_OK;
 }
 
+/*
+ * Seal one chunk. The payload tag is appended right after p, so passing
+ * c == p - CHUNK_SIZE_LEN - tag_len seals the payload in place.
+ */
+static int
+aead_chunk_encrypt(cipher_ctx_t *ctx, uint8_t *p, uint8_t *c, uint8_t *n,
+                   uint16_t plen)
+{
+    uint8_t *out = c + CHUNK_SIZE_LEN + ctx->cipher->tag_len;
+
+    return aead_chunk_seal(ctx, c, p, out, out + plen, n, plen);
+}
+
 /* TCP */
 int
 aead_encrypt(buffer_t *plaintext, cipher_ctx_t *cipher_ctx, size_t capacity)
@@ -615,49 +800,167 @@ aead_encrypt(buffer_t *plaintext, cipher_ctx_t *cipher_ctx, size_t capacity)
         return CRYPTO_OK;
     }
 
-    static buffer_t tmp = { 0, 0, 0, NULL };
-    buffer_t *ciphertext;
-
     cipher_t *cipher = cipher_ctx->cipher;
     int err          = CRYPTO_ERROR;
     size_t salt_ofst = 0;
     size_t salt_len  = cipher->key_len;
     size_t tag_len   = cipher->tag_len;
+    size_t i;
 
     if (!cipher_ctx->init) {
         salt_ofst = salt_len;
     }
 
-    size_t out_len = salt_ofst + 2 * tag_len + plaintext->len + CHUNK_SIZE_LEN;
-    brealloc(&tmp, out_len, capacity);
-    ciphertext      = &tmp;
-    ciphertext->len = out_len;
+    /*
+     * The payload is sealed where it lies, at data + idx, and split into as
+     * many CHUNK_SIZE_MASK chunks as needed. The salt and the first encrypted
+     * length go into the headroom in front of it. Without enough headroom,
+     * shift the payload once.
+     */
+    size_t plen      = plaintext->len;
+    size_t chunk_num = (plen + CHUNK_SIZE_MASK - 1) / CHUNK_SIZE_MASK;
+    size_t overhead  = CHUNK_SIZE_LEN + 2 * tag_len;
+    size_t hdr_len   = salt_ofst + CHUNK_SIZE_LEN + tag_len;
+    size_t out_len   = salt_ofst + chunk_num * overhead + plen;
+
+    if (plaintext->idx < hdr_len) {
+        brealloc(plaintext, out_len, capacity);
+        memmove(plaintext->data + hdr_len, plaintext->data + plaintext->idx, plen);
+        plaintext->idx = hdr_len;
+    } else {
+        brealloc(plaintext, plaintext->idx - hdr_len + out_len, capacity);
+    }
+
+    uint8_t *p   = (uint8_t *)plaintext->data + plaintext->idx;
+    uint8_t *out = p - hdr_len;
 
     if (!cipher_ctx->init) {
-        memcpy(ciphertext->data, cipher_ctx->salt, salt_len);
+        memcpy(out, cipher_ctx->salt, salt_len);
         aead_cipher_ctx_set_subkey(cipher_ctx, 1);
         cipher_ctx->init = 1;
     }
 
-    err = aead_chunk_encrypt(cipher_ctx,
-                             (uint8_t *)plaintext->data,
-                             (uint8_t *)ciphertext->data + salt_ofst,
-                             cipher_ctx->nonce, plaintext->len);
-    if (err)
-        return err;
+#ifdef FS_DEBUG
+    dump("PLAIN", (char *)p, plen);
+#endif
+
+    /* open a gap for the header and tags of every following chunk, last first */
+    for (i = chunk_num - 1; i > 0; i--) {
+        size_t ofst = i * CHUNK_SIZE_MASK;
+        memmove(p + ofst + i * overhead, p + ofst, min(plen - ofst, CHUNK_SIZE_MASK));
+    }
+
+    uint8_t *c = out + salt_ofst;
+    for (i = 0; i < chunk_num; i++) {
+        uint16_t len = min(plen - i * CHUNK_SIZE_MASK, CHUNK_SIZE_MASK);
+        err = aead_chunk_encrypt(cipher_ctx, c + CHUNK_SIZE_LEN + tag_len, c,
+                                 cipher_ctx->nonce, len);
+        if (err)
+            return err;
+        c += overhead + len;
+    }
+
+    plaintext->idx = out - (uint8_t *)plaintext->data;
+    plaintext->len = out_len;
 
 #ifdef FS_DEBUG
-    dump("PLAIN", plaintext->data, plaintext->len);
-    dump("CIPHER", ciphertext->data + salt_ofst, ciphertext->len);
+    dump("CIPHER", plaintext->data + plaintext->idx + salt_ofst,
+         plaintext->len - salt_ofst);
 #endif
 
-    brealloc(plaintext, ciphertext->len, capacity);
-    memcpy(plaintext->data, ciphertext->data, ciphertext->len);
-    plaintext->len = ciphertext->len;
+    return CRYPTO_OK;
+}
+
+/*
+ * Same as aead_encrypt(), but the payload is never moved: each chunk is
+ * sealed in place and the salt, lengths and tags are written to civ->hdr.
+ * On return, civ->iov lists the ciphertext in wire order.
+ */
+int
+aead_encrypt_iov(buffer_t *plaintext, cipher_ctx_t *cipher_ctx,
+                 cipher_iov_t *civ, size_t capacity)
+{
+    if (cipher_ctx == NULL)
+        return CRYPTO_ERROR;
+
+    civ->iovcnt = 0;
+    civ->len    = 0;
+
+    if (plaintext->len == 0) {
+        return CRYPTO_OK;
+    }
+
+    cipher_t *cipher = cipher_ctx->cipher;
+    size_t tag_len   = cipher->tag_len;
+    size_t plen      = plaintext->len;
+    size_t chunk_num = (plen + CHUNK_SIZE_MASK - 1) / CHUNK_SIZE_MASK;
+    size_t i;
 
-    return 0;
+    if (chunk_num > CRYPTO_IOV_CHUNKS) {
+        int err = aead_encrypt(plaintext, cipher_ctx, capacity);
+        if (err)
+            return err;
+        civ->iov[0].iov_base = plaintext->data + plaintext->idx;
+        civ->iov[0].iov_len  = plaintext->len;
+        civ->iovcnt          = 1;
+        civ->len             = plaintext->len;
+        return CRYPTO_OK;
+    }
+
+    uint8_t *h    = civ->hdr;
+    uint8_t *p    = (uint8_t *)plaintext->data + plaintext->idx;
+    uint8_t *prev = h;
+
+    if (!cipher_ctx->init) {
+        memcpy(h, cipher_ctx->salt, cipher->key_len);
+        h += cipher->key_len;
+        aead_cipher_ctx_set_subkey(cipher_ctx, 1);
+        cipher_ctx->init = 1;
+    }
+
+#ifdef FS_DEBUG
+    dump("PLAIN", (char *)p, plen);
+#endif
+
+    /*
+     * The payload tag of one chunk and the header of the next one are
+     * adjacent on the wire, so they share a slot in hdr:
+     * [salt, len0] [p0] [tag0, len1] [p1] ... [tagN]
+     */
+    for (i = 0; i < chunk_num; i++) {
+        uint16_t len  = min(plen - i * CHUNK_SIZE_MASK, CHUNK_SIZE_MASK);
+        uint8_t *hdr  = h;
+        uint8_t *ptag = h + CHUNK_SIZE_LEN + tag_len;
+
+        int err = aead_chunk_seal(cipher_ctx, hdr, p, p, ptag, cipher_ctx->nonce, len);
+        if (err)
+            return err;
+
+        struct iovec *v = civ->iov + civ->iovcnt;
+        v[0].iov_base = prev;
+        v[0].iov_len  = hdr + CHUNK_SIZE_LEN + tag_len - prev;
+        v[1].iov_base = p;
+        v[1].iov_len  = len;
+        civ->iovcnt  += 2;
+
+        prev = ptag;
+        h    = ptag + tag_len;
+        p   += len;
+    }
+
+    civ->iov[civ->iovcnt].iov_base = prev;
+    civ->iov[civ->iovcnt].iov_len  = tag_len;
+    civ->iovcnt++;
+
+    civ->len = h - civ->hdr + plen;
+
+    return CRYPTO_OK;
 }
 
+/*
+ * Open one chunk from c into p. On success, *clen is reduced by the size
+ * of the chunk consumed, c itself is left untouched.
+ */
 static int
 aead_chunk_decrypt(cipher_ctx_t *ctx, uint8_t *p, uint8_t *c, uint8_t *n,
                    size_t *plen, size_t *clen)
@@ -705,9 +1008,6 @@ aead_chunk_decrypt(cipher_ctx_t *ctx, uint8_t *p, uint8_t *c, uint8_t *n,
 
     sodium_increment(n, nlen);
 
-    if (*clen > chunk_len)
-        memmove(c, c + chunk_len, *clen - chunk_len);
-
     *clen -= chunk_len;
 
     return CRYPTO_OK;
@@ -716,36 +1016,37 @@ aead_chunk_decrypt(cipher_ctx_t *ctx, uint8_t *p, uint8_t *c, uint8_t *n,
 int
 aead_decrypt(buffer_t *ciphertext, cipher_ctx_t *cipher_ctx, size_t capacity)
 {
-    int err             = CRYPTO_OK;
-    static buffer_t tmp = { 0, 0, 0, NULL };
+    int err = CRYPTO_OK;
 
     cipher_t *cipher = cipher_ctx->cipher;
+    buffer_t *chunk  = cipher_ctx->chunk;
 
     size_t salt_len = cipher->key_len;
 
-    if (cipher_ctx->chunk == NULL) {
-        cipher_ctx->chunk = (buffer_t *)ss_malloc(sizeof(buffer_t));
-        memset(cipher_ctx->chunk, 0, sizeof(buffer_t));
-        balloc(cipher_ctx->chunk, capacity);
+    if (chunk == NULL) {
+        chunk = (buffer_t *)ss_malloc(sizeof(buffer_t));
+        memset(chunk, 0, sizeof(buffer_t));
+        balloc(chunk, capacity);
+        cipher_ctx->chunk = chunk;
     }
 
-    brealloc(cipher_ctx->chunk,
-             cipher_ctx->chunk->len + ciphertext->len, capacity);
-    memcpy(cipher_ctx->chunk->data + cipher_ctx->chunk->len,
-           ciphertext->data, ciphertext->len);
-    cipher_ctx->chunk->len += ciphertext->len;
+    brealloc(chunk, chunk->len + ciphertext->len, capacity);
+    memcpy(chunk->data + chunk->len, ciphertext->data, ciphertext->len);
+    chunk->len += ciphertext->len;
 
-    brealloc(&tmp, cipher_ctx->chunk->len, capacity);
-    buffer_t *plaintext = &tmp;
+    /* bytes of the chunk buffer consumed so far */
+    size_t cidx = 0;
 
     if (!cipher_ctx->init) {
-        if (cipher_ctx->chunk->len <= salt_len)
+        if (chunk->len <= salt_len)
             return CRYPTO_NEED_MORE;
-        memcpy(cipher_ctx->salt, cipher_ctx->chunk->data, salt_len);
+        memcpy(cipher_ctx->salt, chunk->data, salt_len);
 
         aead_cipher_ctx_set_subkey(cipher_ctx, 0);
 
 #ifdef MODULE_REMOTE
+        // added only once a chunk authenticates, random salts must not
+        // fill up the filter
         err = fs_sbf_check((void *)cipher_ctx->salt, salt_len);
         if (err == 1) {
             LOGE("crypto: AEAD: repeat salt detected");
@@ -753,50 +1054,67 @@ aead_decrypt(buffer_t *ciphertext, cipher_ctx_t *cipher_ctx, size_t capacity)
         } else if (err < 0) {
             LOGE("crypto: AEAD: fail to check salt");
         }
-        if (fs_sbf_add((void *)cipher_ctx->salt, salt_len) < 0)
-            LOGE("crypto: AEAD: fail to add salt");
 #endif
 
-        memmove(cipher_ctx->chunk->data, cipher_ctx->chunk->data + salt_len,
-                cipher_ctx->chunk->len - salt_len);
-        cipher_ctx->chunk->len -= salt_len;
-
+        cidx             = salt_len;
         cipher_ctx->init = 1;
     }
 
+    /*
+     * The input has been copied into the chunk buffer, so the plaintext
+     * is written straight back into the caller's buffer.
+     */
+    brealloc(ciphertext, chunk->len, capacity);
+
     size_t plen = 0;
-    while (cipher_ctx->chunk->len > 0) {
-        size_t chunk_clen = cipher_ctx->chunk->len;
+    while (chunk->len > cidx) {
+        size_t chunk_clen = chunk->len - cidx;
         size_t chunk_plen = 0;
         err = aead_chunk_decrypt(cipher_ctx,
-                                 (uint8_t *)plaintext->data + plen,
-                                 (uint8_t *)cipher_ctx->chunk->data,
+                                 (uint8_t *)ciphertext->data + plen,
+                                 (uint8_t *)chunk->data + cidx,
                                  cipher_ctx->nonce,
                                  &chunk_plen, &chunk_clen);
         if (err == CRYPTO_ERROR) {
-            dump("[E] TCP chunk", cipher_ctx->chunk->data, chunk_clen);
+            dump("[E] TCP chunk", chunk->data + cidx, chunk->len - cidx);
             return err;
         } else if (err == CRYPTO_NEED_MORE) {
-            if (plen == 0) {
-                return err;
-            } else {
-                break;
+            break;
+        }
+        cidx  = chunk->len - chunk_clen;
+        plen += chunk_plen;
+
+#ifdef MODULE_REMOTE
+        if (!cipher_ctx->salt_added) {
+            // another worker may have let the same salt in meanwhile
+            err = fs_sbf_check_and_add((void *)cipher_ctx->salt, salt_len);
+            if (err == 1) {
+                LOGE("crypto: AEAD: repeat salt detected");
+                return CRYPTO_ERROR;
+            } else if (err < 0) {
+                LOGE("crypto: AEAD: fail to add salt");
             }
+            cipher_ctx->salt_added = 1;
         }
-        cipher_ctx->chunk->len = chunk_clen;
-        plen                  += chunk_plen;
+#endif
     }
-    plaintext->len = plen;
+
+    /* keep only the incomplete tail for the next call */
+    if (cidx > 0) {
+        if (chunk->len > cidx)
+            memmove(chunk->data, chunk->data + cidx, chunk->len - cidx);
+        chunk->len -= cidx;
+    }
+
+    if (plen == 0)
+        return CRYPTO_NEED_MORE;
+
+    ciphertext->len = plen;
 
 #ifdef FS_DEBUG
-    dump("PLAIN", plaintext->data, plaintext->len);
-    dump("CIPHER", ciphertext->data + salt_len, ciphertext->len - salt_len);
+    dump("PLAIN", ciphertext->data, ciphertext->len);
 #endif
 
-    brealloc(ciphertext, plaintext->len, capacity);
-    memcpy(ciphertext->data, plaintext->data, plaintext->len);
-    ciphertext->len = plaintext->len;
-
     return CRYPTO_OK;
 }
 
@@ -836,6 +1154,11 @@ aead_key_init(int method, const char *pass)
     cipher->tag_len   = supported_aead_ciphers_tag_size[method];
     cipher->method    = method;
 
+    /* libsodium only does AES-GCM with 256 bit keys, and needs AES-NI */
+    if (method == AES256GCM && crypto_aead_aes256gcm_is_available()) {
+        cipher->aes_gcm = aead_aes_gcm_new(cipher->key);
+    }
+
     return cipher;
 }
 
@@ -856,3 +1179,19 @@ aead_init(const char *pass, const char *method)
     }
     return aead_key_init(m, pass);
 }
+
+void
+aead_release(cipher_t *cipher)
+{
+    if (cipher == NULL)
+        return;
+
+    if (cipher->aes_gcm != NULL) {
+        aead_aes_gcm_free(cipher->aes_gcm);
+    }
+    if (cipher->method >= CHACHA20POLY1305) {
+        ss_free(cipher->info);
+    }
+    sodium_memzero(cipher->key, sizeof(cipher->key));
+    ss_free(cipher);
+}
@@ -32,10 +32,12 @@ int aead_decrypt_all(buffer_t *, cipher_t *, size_t);
 
 int aead_encrypt(buffer_t *, cipher_ctx_t *, size_t);
 int aead_decrypt(buffer_t *, cipher_ctx_t *, size_t);
+int aead_encrypt_iov(buffer_t *, cipher_ctx_t *, cipher_iov_t *, size_t);
 
 void aead_ctx_init(cipher_t *, cipher_ctx_t *, int);
 void aead_ctx_release(cipher_ctx_t *);
 
 cipher_t *aead_init(const char *pass, const char *method);
+void aead_release(cipher_t *cipher);
 
 #endif // _AEAD_H
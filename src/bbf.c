@@ -0,0 +1,284 @@
+#include <math.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "bbf.h"
+
+#include "utils.h"
+/*
+ * Static definitions
+ */
+// Vaguely like CBLOCDD
+#define MAGIC_HEADER  ((uint32_t)0xCB10C0DD)
+
+/*
+ * Odd multipliers, one per word of a block. The top 5 bits of
+ * hash * salt pick the bit to use in that word.
+ */
+static const uint32_t bbf_salts[BBF_BLOCK_WORDS] = {
+    0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+    0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U,
+    0x52e6b439U, 0xf2a74de5U, 0x269e0d37U, 0x6513270fU,
+    0xa6a3a451U, 0x0c5c7fd1U, 0x128b2f33U, 0xd23f0825U
+};
+
+/**
+ * Creates a new blocked bloom filter using a given bitmap.
+ * @arg map A bloom_bitmap pointer, sized with bbf_params_for_capacity.
+ * @arg new_filter 1 if new, sets the magic byte and does not check it.
+ * @arg filter The filter to setup
+ * @return 0 for success. Negative for error.
+ */
+int bbf_from_bitmap(bloom_bitmap *map, int new_filter, bloom_bbf *filter) {
+    // Check our args
+    if (map == NULL) {
+        return -EINVAL;
+    }
+
+    // We need the header and at least one block
+    if (map->size < sizeof(bloom_filter_header) + BBF_BLOCK_BYTES) {
+        return -ENOMEM;
+    }
+
+    // Setup the pointers, the header keeps the blocks cache line aligned
+    filter->map = map;
+    filter->header = (bloom_filter_header*)map->mmap;
+    filter->blocks = (uint32_t*)(map->mmap + sizeof(bloom_filter_header));
+    filter->num_blocks = (map->size - sizeof(bloom_filter_header)) / BBF_BLOCK_BYTES;
+
+    if (new_filter) {
+        filter->header->magic = MAGIC_HEADER;
+        filter->header->k_num = BBF_BLOCK_WORDS;
+        filter->header->count = 0;
+
+        // Force a flush of the headers, see bf_from_bitmap
+        bbf_flush(filter);
+    } else if (filter->header->magic != MAGIC_HEADER) {
+        LOGE("Magic byte for blocked bloom filter is wrong! Aborting load.");
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Hashes a key once and returns its block. The bit to test
+ * in every word of the block is written out to mask.
+ */
+static inline uint32_t* bbf_locate(bloom_bbf *filter, const void *key, uint64_t len,
+                                   uint32_t *mask) {
+    uint64_t out[2];
+    uint32_t h;
+    uint32_t i;
+
+    MurmurHash3_x64_128(key, len, 0, out);
+
+    // Upper 64bits pick the block, lower 32bits the bits inside it
+    h = (uint32_t)out[1];
+    for (i = 0; i < BBF_BLOCK_WORDS; i++) {
+        mask[i] = 1U << ((h * bbf_salts[i]) >> 27);
+    }
+
+    return filter->blocks + (out[0] % filter->num_blocks) * BBF_BLOCK_WORDS;
+}
+
+/**
+ * Returns non-zero if any bit of mask is missing from the block.
+ */
+static inline uint32_t bbf_missing(const uint32_t *block, const uint32_t *mask) {
+    uint32_t missing = 0;
+    uint32_t i;
+
+    for (i = 0; i < BBF_BLOCK_WORDS; i++) {
+        missing |= ~block[i] & mask[i];
+    }
+    return missing;
+}
+
+/**
+ * Adds a new key to the filter.
+ * @arg filter The filter to add to
+ * @arg key The key to add
+ * @returns 1 if the key was added, 0 if present.
+ */
+int bbf_add(bloom_bbf *filter, const void *key, uint64_t len) {
+    uint32_t mask[BBF_BLOCK_WORDS];
+    uint32_t *block = bbf_locate(filter, key, len, mask);
+    uint32_t i;
+
+    if (!bbf_missing(block, mask)) {
+        return 0;  // Key already present, do not add.
+    }
+
+    for (i = 0; i < BBF_BLOCK_WORDS; i++) {
+        block[i] |= mask[i];
+    }
+    bitmap_mark_dirty(filter->map, ((unsigned char*)block - filter->map->mmap) * 8);
+
+    filter->header->count += 1;
+    return 1;
+}
+
+/**
+ * Adds a new key to the filter using atomic word operations.
+ * Two processes adding the same key at the very same time may both
+ * see it as new, any later add sees it as present.
+ * @arg filter The filter to add to
+ * @arg key The key to add
+ * @returns 1 if the key was added, 0 if present.
+ */
+int bbf_add_atomic(bloom_bbf *filter, const void *key, uint64_t len) {
+    uint32_t mask[BBF_BLOCK_WORDS];
+    uint32_t *block = bbf_locate(filter, key, len, mask);
+    uint32_t i;
+    int added = 0;
+
+    // Most keys are new, but replays should not dirty the cache line
+    if (!bbf_missing(block, mask)) {
+        return 0;
+    }
+
+    for (i = 0; i < BBF_BLOCK_WORDS; i++) {
+        if (!(__atomic_fetch_or(&block[i], mask[i], __ATOMIC_RELAXED) & mask[i])) {
+            added = 1;
+        }
+    }
+
+    if (added) {
+        // The header is packed, address the counter through its offset
+        uint64_t *count = (uint64_t *)((char *)filter->header +
+                offsetof(bloom_filter_header, count));
+        __atomic_add_fetch(count, 1, __ATOMIC_RELAXED);
+    }
+    return added;
+}
+
+/**
+ * Checks the filter for a key
+ * @arg filter The filter to check
+ * @arg key The key to check
+ * @returns 1 if present, 0 if not present.
+ */
+int bbf_contains(bloom_bbf *filter, const void *key, uint64_t len) {
+    uint32_t mask[BBF_BLOCK_WORDS];
+    uint32_t *block = bbf_locate(filter, key, len, mask);
+    return !bbf_missing(block, mask);
+}
+
+/**
+ * Removes every key from the filter.
+ * @return 0 on success, negative on failure.
+ */
+int bbf_clear(bloom_bbf *filter) {
+    if (filter == NULL || filter->map == NULL) {
+        return -1;
+    }
+    memset(filter->blocks, 0, filter->num_blocks * BBF_BLOCK_BYTES);
+    filter->header->count = 0;
+    return 0;
+}
+
+/**
+ * Returns the size of the filter in item count
+ */
+uint64_t bbf_size(bloom_bbf *filter) {
+    return filter->header->count;
+}
+
+/**
+ * Flushes the filter, and updates the metadata.
+ * @return 0 on success, negative on failure.
+ */
+int bbf_flush(bloom_bbf *filter) {
+    if (filter == NULL || filter->map == NULL) {
+        return -1;
+    }
+    return bitmap_flush(filter->map);
+}
+
+/**
+ * Flushes and closes the filter. Closes the underlying bitmap,
+ * but does not free it.
+ * @return 0 on success, negative on failure.
+ */
+int bbf_close(bloom_bbf *filter) {
+    if (filter == NULL || filter->map == NULL) {
+        return -1;
+    }
+
+    bbf_flush(filter);
+    bitmap_close(filter->map);
+
+    filter->map = NULL;
+    filter->header = NULL;
+    filter->blocks = NULL;
+    filter->num_blocks = 0;
+    return 0;
+}
+
+/*
+ * Utility methods
+ */
+
+/*
+ * The number of keys in a block is Poisson distributed. A key with
+ * i others in its block finds each of its bits set with probability
+ * 1 - (1 - 1/32)^i, so sum that over the distribution.
+ */
+static double bbf_fp_probability(double keys_per_block) {
+    double bits = BBF_BLOCK_BYTES * 8;
+    double fp = 0;
+    double p = exp(-keys_per_block);   // P(0 keys)
+    uint64_t last = keys_per_block + 10 * sqrt(keys_per_block) + 10;
+    uint64_t i;
+
+    for (i = 0; i <= last; i++) {
+        double word_hit = 1 - pow(1 - BBF_BLOCK_WORDS / bits, i);
+        fp += p * pow(word_hit, BBF_BLOCK_WORDS);
+        p = p * keys_per_block / (i + 1);
+    }
+    return fp;
+}
+
+/*
+ * Expects capacity and probability to be set, and sets the bytes
+ * (header included) and k_num of a blocked filter.
+ * @return 0 on success, negative on error.
+ */
+int bbf_params_for_capacity(bloom_filter_params *params) {
+    uint64_t capacity = params->capacity;
+    double fp_prob = params->fp_probability;
+    if (capacity == 0 || fp_prob <= 0 || fp_prob >= 1) {
+        return -1;
+    }
+
+    // Start from the size of a classic filter and grow it by 1% at
+    // a time, the blocked filter never needs less.
+    double bits = -(capacity*log(fp_prob)/(log(2)*log(2)));
+    uint64_t num_blocks = ceil(bits / (BBF_BLOCK_BYTES * 8));
+    while (bbf_fp_probability((double)capacity / num_blocks) > fp_prob) {
+        num_blocks += num_blocks / 100 + 1;
+    }
+
+    params->bytes = num_blocks * BBF_BLOCK_BYTES + sizeof(bloom_filter_header);
+    params->k_num = BBF_BLOCK_WORDS;
+    return 0;
+}
+
+/*
+ * Expects bytes (header included) and capacity to be set, computes
+ * the expected false positive probability of a blocked filter.
+ * @return 0 on success, negative on error.
+ */
+int bbf_fp_probability_for_capacity_size(bloom_filter_params *params) {
+    if (params->bytes <= sizeof(bloom_filter_header) || params->capacity == 0) {
+        return -1;
+    }
+    uint64_t num_blocks = (params->bytes - sizeof(bloom_filter_header)) / BBF_BLOCK_BYTES;
+    if (num_blocks == 0) {
+        return -1;
+    }
+    params->fp_probability = bbf_fp_probability((double)params->capacity / num_blocks);
+    return 0;
+}
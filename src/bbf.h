@@ -0,0 +1,102 @@
+#ifndef BLOOM_BBF_H
+#define BLOOM_BBF_H
+#include "bloom.h"
+
+/**
+ * A blocked bloom filter keeps all the bits of a key inside one
+ * 64 byte block, so a lookup costs a single cache miss instead of
+ * k_num of them. The block is split in 16 words of 32 bits and a
+ * key sets exactly one bit in each word, derived from one hash with
+ * a multiply-shift per word. The loops over the words have no
+ * branches and are auto-vectorized by the compiler.
+ *
+ * It shares the header and the bitmap with bloom_bloomfilter, but
+ * uses its own magic so the two cannot be loaded as each other.
+ */
+#define BBF_BLOCK_BYTES 64
+#define BBF_BLOCK_WORDS (BBF_BLOCK_BYTES / sizeof(uint32_t))
+
+typedef struct {
+    bloom_filter_header *header;   // Pointer to the header in the bitmap region
+    bloom_bitmap *map;             // Underlying bitmap
+    uint32_t *blocks;              // The first block, right after the header
+    uint64_t num_blocks;           // Number of blocks in the bitmap
+} bloom_bbf;
+
+/**
+ * Creates a new blocked bloom filter using a given bitmap.
+ * @arg map A bloom_bitmap pointer, sized with bbf_params_for_capacity.
+ * @arg new_filter 1 if new, sets the magic byte and does not check it.
+ * @arg filter The filter to setup
+ * @return 0 for success. Negative for error.
+ */
+int bbf_from_bitmap(bloom_bitmap *map, int new_filter, bloom_bbf *filter);
+
+/**
+ * Adds a new key to the filter.
+ * @arg filter The filter to add to
+ * @arg key The key to add
+ * @returns 1 if the key was added, 0 if present.
+ */
+int bbf_add(bloom_bbf *filter, const void *key, uint64_t len);
+
+/**
+ * Adds a new key to the filter using atomic word operations, so
+ * several processes can share one filter without a lock. As with
+ * bf_add_atomic, the key is reported as present only if every one
+ * of its bits was already set.
+ * @arg filter The filter to add to
+ * @arg key The key to add
+ * @returns 1 if the key was added, 0 if present.
+ */
+int bbf_add_atomic(bloom_bbf *filter, const void *key, uint64_t len);
+
+/**
+ * Checks the filter for a key
+ * @arg filter The filter to check
+ * @arg key The key to check
+ * @returns 1 if present, 0 if not present.
+ */
+int bbf_contains(bloom_bbf *filter, const void *key, uint64_t len);
+
+/**
+ * Removes every key from the filter.
+ * @return 0 on success, negative on failure.
+ */
+int bbf_clear(bloom_bbf *filter);
+
+/**
+ * Returns the size of the filter in item count
+ */
+uint64_t bbf_size(bloom_bbf *filter);
+
+/**
+ * Flushes the filter, and updates the metadata.
+ * @return 0 on success, negative on failure.
+ */
+int bbf_flush(bloom_bbf *filter);
+
+/**
+ * Flushes and closes the filter. Closes the underlying bitmap,
+ * but does not free it.
+ * @return 0 on success, negative on failure.
+ */
+int bbf_close(bloom_bbf *filter);
+
+/*
+ * Expects capacity and probability to be set, and sets the bytes
+ * (header included) and k_num of a blocked filter. Blocks fill up
+ * unevenly, so this takes more bytes than bf_params_for_capacity
+ * for the same false positive probability.
+ * @return 0 on success, negative on error.
+ */
+int bbf_params_for_capacity(bloom_filter_params *params);
+
+/*
+ * Expects bytes (header included) and capacity to be set, computes
+ * the expected false positive probability of a blocked filter.
+ * @return 0 on success, negative on error.
+ */
+int bbf_fp_probability_for_capacity_size(bloom_filter_params *params);
+
+#endif
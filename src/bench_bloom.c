@@ -0,0 +1,190 @@
+/*
+ * bench_bloom.c - Compare the classic and the blocked bloom filter lookups
+ *
+ * Copyright (C) 2013 - 2017, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Fills a bf_* and a bbf_* filter sized for the same capacity and error
+ * rate with the same 32 byte salts, then times the lookups of salts that
+ * are present (every bit has to be checked) and of fresh ones (the usual
+ * case for a salt filter, and where false positives show up).
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "bloom.h"
+#include "bbf.h"
+#include "utils.h"
+
+#define SALT_LEN 32
+
+static void
+make_salt(uint64_t seed, unsigned char *salt)
+{
+    int i;
+    // splitmix64, good enough to look random to the hash functions
+    for (i = 0; i < SALT_LEN; i += 8) {
+        uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        z = z ^ (z >> 31);
+        memcpy(salt + i, &z, 8);
+    }
+}
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+typedef int (*contains_fn)(void *filter, const void *key, uint64_t len);
+
+static int
+classic_contains(void *filter, const void *key, uint64_t len)
+{
+    return bf_contains(filter, key, len);
+}
+
+static int
+blocked_contains(void *filter, const void *key, uint64_t len)
+{
+    return bbf_contains(filter, key, len);
+}
+
+/*
+ * Looks up salts [first, first + num) and returns the number found.
+ * The salts are generated up front so only the lookups are timed.
+ */
+static uint64_t
+lookup(contains_fn contains, void *filter, unsigned char *salts,
+       uint64_t num, double *elapsed)
+{
+    uint64_t i, found = 0;
+    double start = now();
+
+    for (i = 0; i < num; i++) {
+        found += contains(filter, salts + i * SALT_LEN, SALT_LEN) == 1;
+    }
+
+    *elapsed = now() - start;
+    return found;
+}
+
+static void
+report(const char *name, const char *phase, uint64_t num, double elapsed,
+       const char *bad, uint64_t bad_num)
+{
+    printf("%-8s %-7s %8.1f ns/op %10.0f ops/s   %s: %" PRIu64 " (%.3g)\n",
+           name, phase, elapsed * 1e9 / num, num / elapsed, bad, bad_num,
+           (double)bad_num / num);
+}
+
+static void
+run(const char *name, contains_fn contains, void *filter,
+    unsigned char *present, unsigned char *fresh, uint64_t num)
+{
+    double elapsed;
+    uint64_t found;
+
+    found = lookup(contains, filter, present, num, &elapsed);
+    report(name, "present", num, elapsed, "misses", num - found);
+
+    found = lookup(contains, filter, fresh, num, &elapsed);
+    report(name, "fresh", num, elapsed, "false positives", found);
+}
+
+int
+main(int argc, char **argv)
+{
+    int c;
+    uint64_t i;
+    uint64_t salt_num = 1000000;
+    double err_rate   = 1e-6;
+
+    while ((c = getopt(argc, argv, "n:p:")) != -1) {
+        switch (c) {
+        case 'n':
+            salt_num = strtoull(optarg, NULL, 10);
+            break;
+        case 'p':
+            err_rate = atof(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n salts] [-p error rate]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (salt_num < 1 || err_rate <= 0 || err_rate >= 1) {
+        fprintf(stderr, "invalid arguments\n");
+        return 1;
+    }
+
+    bloom_filter_params classic_params = { 0, 0, salt_num, err_rate };
+    bloom_filter_params blocked_params = { 0, 0, salt_num, err_rate };
+    bloom_bitmap classic_map, blocked_map;
+    bloom_bloomfilter classic;
+    bloom_bbf blocked;
+
+    if (bf_params_for_capacity(&classic_params) != 0
+        || bitmap_from_file(-1, classic_params.bytes, ANONYMOUS, &classic_map) != 0
+        || bf_from_bitmap(&classic_map, classic_params.k_num, 1, &classic) != 0) {
+        FATAL("failed to create the classic filter");
+    }
+    if (bbf_params_for_capacity(&blocked_params) != 0
+        || bitmap_from_file(-1, blocked_params.bytes, ANONYMOUS, &blocked_map) != 0
+        || bbf_from_bitmap(&blocked_map, 1, &blocked) != 0) {
+        FATAL("failed to create the blocked filter");
+    }
+
+    unsigned char *present = ss_malloc(salt_num * SALT_LEN);
+    unsigned char *fresh   = ss_malloc(salt_num * SALT_LEN);
+    for (i = 0; i < salt_num; i++) {
+        make_salt(i, present + i * SALT_LEN);
+        make_salt(salt_num + i, fresh + i * SALT_LEN);
+        bf_add(&classic, present + i * SALT_LEN, SALT_LEN);
+        bbf_add(&blocked, present + i * SALT_LEN, SALT_LEN);
+    }
+
+    printf("%" PRIu64 " salts at %g\n", salt_num, err_rate);
+    printf("classic  %8" PRIu64 " KB, k = %u\n", classic_params.bytes / 1024, classic_params.k_num);
+    printf("blocked  %8" PRIu64 " KB, k = %u\n", blocked_params.bytes / 1024, blocked_params.k_num);
+
+    run("classic", classic_contains, &classic, present, fresh, salt_num);
+    run("blocked", blocked_contains, &blocked, present, fresh, salt_num);
+
+    ss_free(present);
+    ss_free(fresh);
+    bf_close(&classic);
+    bbf_close(&blocked);
+
+    return 0;
+}
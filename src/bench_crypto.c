@@ -0,0 +1,388 @@
+/*
+ * bench_crypto.c - Measure the TCP and UDP encryption paths of every cipher
+ *
+ * Copyright (C) 2013 - 2017, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Drives the crypto_t of a method the way the relays do, for payloads
+ * from 64 bytes to CRYPTO_BENCH_CHUNK, the largest TCP chunk:
+ *
+ *  tcp enc:  encrypt() of one session, the payload read at CRYPTO_HEADROOM
+ *  tcp dec:  decrypt() of that session, each piece copied into the buffer
+ *            first, as recv() would
+ *  udp enc:  encrypt_all() of one packet, a new salt or IV every time
+ *  udp dec:  decrypt_all() of such packets, copied in first as well
+ *
+ * and reports the throughput of the plaintext, the time per call and the
+ * number of malloc(), calloc(), realloc() and posix_memalign() calls per
+ * call. Only the allocations of our own code are counted, they are wrapped
+ * at link time with -Wl,--wrap, those inside libsodium and mbed TLS are not.
+ *
+ * With -l, it times every single TCP encrypt() of 1 to 128 bytes instead,
+ * the size of keystrokes and small frames, where the latency of sealing a
+ * chunk matters more than the throughput. Each chunk is opened again to
+ * check it.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "crypto.h"
+#include "utils.h"
+
+#define MAX_METHODS 32
+
+#define LATENCY_OPS 100000
+
+static const size_t sizes[] = { 64, 256, 1024, 4096, CRYPTO_BENCH_CHUNK };
+static const size_t small_sizes[] = { 1, 2, 4, 8, 16, 32, 64, 128 };
+
+// AEAD ciphers, and the default and the most used stream ciphers
+static const char *default_methods[] = {
+    "aes-128-gcm",
+    "aes-192-gcm",
+    "aes-256-gcm",
+    "chacha20-poly1305",
+    "chacha20-ietf-poly1305",
+    "xchacha20-ietf-poly1305",
+    "rc4-md5",
+    "aes-256-cfb",
+    "chacha20-ietf",
+};
+
+static uint64_t alloc_num = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+int __real_posix_memalign(void **memptr, size_t alignment, size_t size);
+
+void *
+__wrap_malloc(size_t size)
+{
+    alloc_num++;
+    return __real_malloc(size);
+}
+
+void *
+__wrap_calloc(size_t nmemb, size_t size)
+{
+    alloc_num++;
+    return __real_calloc(nmemb, size);
+}
+
+void *
+__wrap_realloc(void *ptr, size_t size)
+{
+    alloc_num++;
+    return __real_realloc(ptr, size);
+}
+
+int
+__wrap_posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    alloc_num++;
+    return __real_posix_memalign(memptr, alignment, size);
+}
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+typedef struct {
+    double start;
+    uint64_t allocs;
+} bench_clock_t;
+
+static void
+bench_start(bench_clock_t *clock)
+{
+    clock->allocs = alloc_num;
+    clock->start  = now();
+}
+
+static void
+report(const char *method, const char *phase, size_t size, uint64_t ops,
+       bench_clock_t *clock)
+{
+    double elapsed = now() - clock->start;
+    printf("%-24s %-7s %6zu %10.1f MB/s %10.1f ns/op %6.2f allocs/op\n",
+           method, phase, size, size * ops / elapsed / 1e6,
+           elapsed * 1e9 / ops, (double)(alloc_num - clock->allocs) / ops);
+}
+
+/*
+ * Every piece of ciphertext is kept in one buffer for the decryption,
+ * each one prefixed with its length.
+ */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t capacity;
+} tape_t;
+
+static void
+tape_put(tape_t *tape, const char *data, size_t len)
+{
+    if (tape->len + sizeof(size_t) + len > tape->capacity) {
+        tape->capacity = (tape->len + sizeof(size_t) + len) * 2;
+        tape->data     = ss_realloc(tape->data, tape->capacity);
+    }
+    memcpy(tape->data + tape->len, &len, sizeof(size_t));
+    memcpy(tape->data + tape->len + sizeof(size_t), data, len);
+    tape->len += sizeof(size_t) + len;
+}
+
+static const char *
+tape_get(tape_t *tape, size_t *ofst, size_t *len)
+{
+    const char *data;
+    memcpy(len, tape->data + *ofst, sizeof(size_t));
+    data   = tape->data + *ofst + sizeof(size_t);
+    *ofst += sizeof(size_t) + *len;
+    return data;
+}
+
+static void
+fill(buffer_t *buf, size_t idx, size_t size)
+{
+    buf->idx = idx;
+    buf->len = size;
+    memset(buf->data + buf->idx, 0x5a, size);
+}
+
+static void
+bench_tcp(const char *method, crypto_t *crypto, size_t size, uint64_t ops,
+          tape_t *tape)
+{
+    bench_clock_t clock;
+    cipher_ctx_t enc, dec;
+    buffer_t buf;
+    size_t capacity = CRYPTO_HEADROOM + size * 2 + 1024;
+    size_t ofst     = 0;
+    uint64_t i;
+
+    balloc(&buf, capacity);
+
+    crypto->ctx_init(crypto->cipher, &enc, 1);
+    bench_start(&clock);
+    for (i = 0; i < ops; i++) {
+        fill(&buf, CRYPTO_HEADROOM, size);
+        if (crypto->encrypt(&buf, &enc, capacity) != CRYPTO_OK)
+            FATAL("tcp encryption failed");
+    }
+    report(method, "tcp enc", size, ops, &clock);
+    crypto->ctx_release(&enc);
+
+    // a fresh session, its ciphertext recorded for the decryption
+    tape->len = 0;
+    crypto->ctx_init(crypto->cipher, &enc, 1);
+    for (i = 0; i < ops; i++) {
+        fill(&buf, CRYPTO_HEADROOM, size);
+        if (crypto->encrypt(&buf, &enc, capacity) != CRYPTO_OK)
+            FATAL("tcp encryption failed");
+        tape_put(tape, buf.data + buf.idx, buf.len);
+    }
+    crypto->ctx_release(&enc);
+
+    crypto->ctx_init(crypto->cipher, &dec, 0);
+    bench_start(&clock);
+    for (i = 0; i < ops; i++) {
+        size_t len;
+        const char *data = tape_get(tape, &ofst, &len);
+        memcpy(buf.data, data, len);
+        buf.idx = 0;
+        buf.len = len;
+        if (crypto->decrypt(&buf, &dec, capacity) != CRYPTO_OK || buf.len != size)
+            FATAL("tcp decryption failed");
+    }
+    report(method, "tcp dec", size, ops, &clock);
+    crypto->ctx_release(&dec);
+
+    bfree(&buf);
+}
+
+static void
+bench_udp(const char *method, crypto_t *crypto, size_t size, uint64_t ops,
+          tape_t *tape)
+{
+    bench_clock_t clock;
+    buffer_t buf;
+    size_t capacity = CRYPTO_HEADROOM + size * 2 + 1024;
+    size_t ofst     = 0;
+    uint64_t i;
+
+    balloc(&buf, capacity);
+
+    bench_start(&clock);
+    for (i = 0; i < ops; i++) {
+        fill(&buf, 0, size);
+        if (crypto->encrypt_all(&buf, crypto->cipher, capacity) != CRYPTO_OK)
+            FATAL("udp encryption failed");
+    }
+    report(method, "udp enc", size, ops, &clock);
+
+    tape->len = 0;
+    for (i = 0; i < ops; i++) {
+        fill(&buf, 0, size);
+        if (crypto->encrypt_all(&buf, crypto->cipher, capacity) != CRYPTO_OK)
+            FATAL("udp encryption failed");
+        tape_put(tape, buf.data, buf.len);
+    }
+
+    bench_start(&clock);
+    for (i = 0; i < ops; i++) {
+        size_t len;
+        const char *data = tape_get(tape, &ofst, &len);
+        memcpy(buf.data, data, len);
+        buf.idx = 0;
+        buf.len = len;
+        if (crypto->decrypt_all(&buf, crypto->cipher, capacity) != CRYPTO_OK
+            || buf.len != size)
+            FATAL("udp decryption failed");
+    }
+    report(method, "udp dec", size, ops, &clock);
+
+    bfree(&buf);
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void
+bench_latency(const char *method, crypto_t *crypto, size_t size, uint64_t ops)
+{
+    cipher_ctx_t enc, dec;
+    buffer_t buf;
+    size_t capacity = CRYPTO_HEADROOM + size * 2 + 1024;
+    double *lat     = ss_malloc(ops * sizeof(double));
+    double total    = 0;
+    uint64_t i;
+    size_t j;
+
+    balloc(&buf, capacity);
+    crypto->ctx_init(crypto->cipher, &enc, 1);
+    crypto->ctx_init(crypto->cipher, &dec, 0);
+
+    for (i = 0; i < ops; i++) {
+        fill(&buf, CRYPTO_HEADROOM, size);
+        double start = now();
+        if (crypto->encrypt(&buf, &enc, capacity) != CRYPTO_OK)
+            FATAL("tcp encryption failed");
+        lat[i]  = now() - start;
+        total  += lat[i];
+
+        memmove(buf.data, buf.data + buf.idx, buf.len);
+        buf.idx = 0;
+        if (crypto->decrypt(&buf, &dec, capacity) != CRYPTO_OK || buf.len != size)
+            FATAL("tcp decryption failed");
+        for (j = 0; j < size; j++)
+            if (buf.data[j] != 0x5a)
+                FATAL("tcp decryption returned garbage");
+    }
+
+    qsort(lat, ops, sizeof(double), cmp_double);
+    printf("%-24s tcp enc %6zu %10.1f ns/op %10.1f ns p50 %10.1f ns p99\n",
+           method, size, total * 1e9 / ops, lat[ops / 2] * 1e9,
+           lat[ops - ops / 100 - 1] * 1e9);
+
+    crypto->ctx_release(&enc);
+    crypto->ctx_release(&dec);
+    bfree(&buf);
+    ss_free(lat);
+}
+
+int
+main(int argc, char **argv)
+{
+    int c, i, method_num = 0, latency = 0;
+    size_t j;
+    uint64_t megabytes = 16;
+    const char *methods[MAX_METHODS];
+    tape_t tape = { NULL, 0, 0 };
+
+    while ((c = getopt(argc, argv, "lm:n:")) != -1) {
+        switch (c) {
+        case 'm':
+            if (method_num == MAX_METHODS) {
+                fprintf(stderr, "too many methods\n");
+                return 1;
+            }
+            methods[method_num++] = optarg;
+            break;
+        case 'n':
+            megabytes = strtoull(optarg, NULL, 10);
+            break;
+        case 'l':
+            latency = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-l] [-m method]... [-n MB per run]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (megabytes < 1) {
+        fprintf(stderr, "invalid arguments\n");
+        return 1;
+    }
+
+    if (method_num == 0) {
+        method_num = sizeof(default_methods) / sizeof(default_methods[0]);
+        memcpy(methods, default_methods, sizeof(default_methods));
+    }
+
+    for (i = 0; i < method_num; i++) {
+        crypto_t *crypto = crypto_init("fuckshadows-bench", methods[i]);
+        if (crypto == NULL)
+            FATAL("failed to initialize ciphers");
+
+        if (latency) {
+            for (j = 0; j < sizeof(small_sizes) / sizeof(small_sizes[0]); j++)
+                bench_latency(methods[i], crypto, small_sizes[j], LATENCY_OPS);
+            continue;
+        }
+
+        for (j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++) {
+            uint64_t ops = megabytes * 1000000 / sizes[j];
+            bench_tcp(methods[i], crypto, sizes[j], ops, &tape);
+            bench_udp(methods[i], crypto, sizes[j], ops, &tape);
+        }
+    }
+
+    ss_free(tape.data);
+
+    return 0;
+}
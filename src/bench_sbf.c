@@ -0,0 +1,237 @@
+/*
+ * bench_sbf.c - Stress the salt filter shared by fs-server workers
+ *
+ * Copyright (C) 2013 - 2017, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Forks a number of workers that check-and-insert 32 byte salts into one
+ * generation of the salt filter in shared memory, the same way fs-server
+ * --workers does: a blocked bloom filter (bbf.h) sized for
+ * FS_BF_ENTRIES__SERVER salts at FS_BF_ERR_RATE__SERVER by default.
+ *
+ *  fresh:     every worker inserts its own salts. Any salt reported as
+ *             present is a false positive, i.e. a legit client rejected.
+ *  replay:    every worker replays the salts of all the others. Any salt
+ *             reported as new is a false accept.
+ *  contended: all workers insert the same salts in the same order at the
+ *             same time. Each salt must be accepted exactly once, every
+ *             extra accept is a replay that slipped through a race.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "bloom.h"
+#include "bbf.h"
+#include "crypto.h"
+#include "utils.h"
+
+#define SALT_LEN 32
+
+typedef struct {
+    uint64_t added;
+    uint64_t present;
+} bench_result_t;
+
+typedef struct {
+    int ready;
+    int go;
+    bench_result_t result[];
+} bench_shared_t;
+
+static int worker_num    = 4;
+static uint64_t salt_num = 1000000;
+
+static bloom_bitmap map;
+static bloom_bbf filter;
+static bench_shared_t *shared;
+
+static void
+make_salt(uint64_t seed, unsigned char *salt)
+{
+    int i;
+    // splitmix64, good enough to look random to the hash functions
+    for (i = 0; i < SALT_LEN; i += 8) {
+        uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        z = z ^ (z >> 31);
+        memcpy(salt + i, &z, 8);
+    }
+}
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Run one phase in worker_num processes started at the same time. Worker w
+ * walks salts [first, last), taking every step-th one and starting w * shift
+ * salts in. Returns the wall clock time of the phase.
+ */
+static double
+run_phase(uint64_t first, uint64_t last, int step, uint64_t shift,
+          bench_result_t *total)
+{
+    int w;
+    double start;
+
+    shared->ready = 0;
+    shared->go    = 0;
+    memset(shared->result, 0, sizeof(bench_result_t) * worker_num);
+
+    for (w = 0; w < worker_num; w++) {
+        pid_t pid = fork();
+        if (pid == -1) {
+            FATAL("fork");
+        } else if (pid == 0) {
+            unsigned char salt[SALT_LEN];
+            bench_result_t *res = &shared->result[w];
+            uint64_t span       = last - first;
+            uint64_t i;
+
+            __atomic_add_fetch(&shared->ready, 1, __ATOMIC_RELEASE);
+            while (!__atomic_load_n(&shared->go, __ATOMIC_ACQUIRE))
+                ;
+
+            for (i = w % step; i < span; i += step) {
+                make_salt(first + (i + w * shift) % span, salt);
+                if (bbf_add_atomic(&filter, salt, SALT_LEN)) {
+                    res->added++;
+                } else {
+                    res->present++;
+                }
+            }
+            _exit(0);
+        }
+    }
+
+    while (__atomic_load_n(&shared->ready, __ATOMIC_ACQUIRE) < worker_num)
+        ;
+    start = now();
+    __atomic_store_n(&shared->go, 1, __ATOMIC_RELEASE);
+
+    for (w = 0; w < worker_num; w++) {
+        wait(NULL);
+    }
+
+    double elapsed = now() - start;
+
+    memset(total, 0, sizeof(bench_result_t));
+    for (w = 0; w < worker_num; w++) {
+        total->added   += shared->result[w].added;
+        total->present += shared->result[w].present;
+    }
+
+    return elapsed;
+}
+
+static void
+report(const char *phase, double elapsed, bench_result_t *res,
+       const char *bad, uint64_t bad_num)
+{
+    uint64_t ops = res->added + res->present;
+    printf("%-10s %10" PRIu64 " ops %8.3f s %10.0f ops/s   %s: %" PRIu64 " (%.3g)\n",
+           phase, ops, elapsed, ops / elapsed, bad, bad_num,
+           ops ? (double)bad_num / ops : 0.0);
+}
+
+int
+main(int argc, char **argv)
+{
+    int c;
+    double capacity = FS_BF_ENTRIES__SERVER;
+    double err_rate = FS_BF_ERR_RATE__SERVER;
+
+    while ((c = getopt(argc, argv, "w:n:c:p:")) != -1) {
+        switch (c) {
+        case 'w':
+            worker_num = atoi(optarg);
+            break;
+        case 'n':
+            salt_num = strtoull(optarg, NULL, 10);
+            break;
+        case 'c':
+            capacity = atof(optarg);
+            break;
+        case 'p':
+            err_rate = atof(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-w workers] [-n salts] "
+                    "[-c filter capacity] [-p error rate]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (worker_num < 1 || salt_num < 1) {
+        fprintf(stderr, "invalid arguments\n");
+        return 1;
+    }
+
+    bloom_filter_params params = { 0, 0, capacity, err_rate };
+    if (bbf_params_for_capacity(&params) != 0
+        || bitmap_from_file(-1, params.bytes, SHARED_ANONYMOUS, &map) != 0
+        || bbf_from_bitmap(&map, 1, &filter) != 0) {
+        FATAL("failed to create the shared filter");
+    }
+
+    shared = mmap(NULL, sizeof(bench_shared_t) + sizeof(bench_result_t) * worker_num,
+                  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+    if (shared == MAP_FAILED) {
+        FATAL("mmap");
+    }
+
+    printf("%d workers, %" PRIu64 " salts, filter %.0f entries at %g, "
+           "%" PRIu64 " KB, k = %u\n", worker_num, salt_num, capacity, err_rate,
+           params.bytes / 1024, params.k_num);
+
+    bench_result_t res;
+    double elapsed;
+
+    elapsed = run_phase(0, salt_num, worker_num, 0, &res);
+    report("fresh", elapsed, &res, "false positives", res.present);
+
+    elapsed = run_phase(0, salt_num, 1, salt_num / worker_num, &res);
+    report("replay", elapsed, &res, "false accepts", res.added);
+
+    elapsed = run_phase(salt_num, 2 * salt_num, 1, 0, &res);
+    report("contended", elapsed, &res, "false accepts",
+           res.added > salt_num ? res.added - salt_num : 0);
+
+    bbf_close(&filter);
+    munmap(shared, sizeof(bench_shared_t) + sizeof(bench_result_t) * worker_num);
+
+    return 0;
+}
@@ -19,6 +19,8 @@ static int flush_dirty_pages(bloom_bitmap *map);
 static int flush_page(bloom_bitmap *map, uint64_t page, uint64_t size, uint64_t max_page);
 extern inline int bitmap_getbit(bloom_bitmap *map, uint64_t idx);
 extern inline void bitmap_setbit(bloom_bitmap *map, uint64_t idx);
+extern inline void bitmap_mark_dirty(bloom_bitmap *map, uint64_t idx);
+extern inline int bitmap_test_and_setbit(bloom_bitmap *map, uint64_t idx);
 
 /**
  * Returns a bloom_bitmap pointer from a file handle
@@ -56,6 +58,10 @@ int bitmap_from_file(int fileno, uint64_t len, bitmap_mode mode, bloom_bitmap *m
         flags = MAP_ANON | MAP_PRIVATE;
         newfileno = -1;
 
+    } else if (mode == SHARED_ANONYMOUS) {
+        flags = MAP_ANON | MAP_SHARED;
+        newfileno = -1;
+
     } else {
         return -1;
     }
@@ -242,7 +248,8 @@ int bitmap_flush(bloom_bitmap *map) {
 
     // Do nothing for anonymous maps
     int res;
-    if (map->mode == ANONYMOUS || map->mmap == NULL)
+    if (map->mode == ANONYMOUS || map->mode == SHARED_ANONYMOUS
+        || map->mmap == NULL)
         return 0;
 
     // For SHARED, we can use an msync and let the kernel deal
@@ -356,7 +363,7 @@ int bitmap_close(bloom_bitmap *map) {
     if (res != 0) return -errno;
 
     // Close the file descriptor if file backed
-    if (map->mode != ANONYMOUS) {
+    if (map->mode != ANONYMOUS && map->mode != SHARED_ANONYMOUS) {
        res = close(map->fileno);
        if (res != 0) return -errno;
     }
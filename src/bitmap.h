@@ -8,7 +8,8 @@ typedef enum {
     SHARED      = 1, // MAP_SHARED mmap used, file backed.
     PERSISTENT  = 2, // MAP_ANONYMOUS used, file backed.
     ANONYMOUS   = 4, // MAP_ANONYMOUS mmap used. No file backing.
-    NEW_BITMAP  = 8  // File contents not read. Used with PERSISTENT
+    NEW_BITMAP  = 8, // File contents not read. Used with PERSISTENT
+    SHARED_ANONYMOUS = 16 // MAP_SHARED | MAP_ANON used. Shared with forked children.
 } bitmap_mode;
 
 typedef struct {
@@ -71,6 +72,31 @@ inline int bitmap_getbit(bloom_bitmap *map, uint64_t idx) {
     return (map->mmap[idx >> 3] >> (7 - (idx % 8))) & 0x1;
 }
 
+/*
+ * Atomically sets a bit and returns its previous value. Safe to call
+ * from several processes sharing a SHARED or SHARED_ANONYMOUS bitmap.
+ * Dirty pages are not tracked, so don't use it in the PERSISTENT mode.
+ */
+inline int bitmap_test_and_setbit(bloom_bitmap *map, uint64_t idx) {
+    unsigned char mask = 1 << (7 - idx % 8);
+    return (__atomic_fetch_or(&map->mmap[idx >> 3], mask, __ATOMIC_RELAXED) & mask) != 0;
+}
+
+/*
+ * Marks the page holding the bit at index idx as dirty
+ * if we are in the PERSISTENT mode
+ */
+inline void bitmap_mark_dirty(bloom_bitmap *map, uint64_t idx) {
+    if (map->mode == PERSISTENT) {
+        // >> 12 for 4096 (bytes/page), >> 3 for 8 (bits/byte)
+        uint64_t page = idx >> 15;
+        unsigned char byte = map->dirty_pages[page >> 3];
+        unsigned char byte_off = 7 - page % 8;
+        byte |= 1 << byte_off;
+        map->dirty_pages[page >> 3] = byte;
+    }
+}
+
 /*
  * Used to set a bit in the bitmap, and as a side affect,
  * mark the page as dirty if we are in the PERSISTENT mode
@@ -82,14 +108,7 @@ inline void bitmap_setbit(bloom_bitmap *map, uint64_t idx) {
     map->mmap[idx >> 3] = byte;
 
     // Check if we need to dirty the page
-    if (map->mode == PERSISTENT) {
-        // >> 12 for 4096 (bytes/page), >> 3 for 8 (bits/byte)
-        uint64_t page = idx >> 15;
-        byte = map->dirty_pages[page >> 3];
-        byte_off = 7 - page % 8;
-        byte |= 1 << byte_off;
-        map->dirty_pages[page >> 3] = byte;
-    }
+    bitmap_mark_dirty(map, idx);
 }
 
 #endif
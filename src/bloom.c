@@ -2,6 +2,7 @@
 #include <iso646.h>
 #include <inttypes.h>
 #include <string.h>
+#include <stddef.h>
 #include <stdio.h>
 #include "bloom.h"
 
@@ -130,6 +131,46 @@ int bf_add(bloom_bloomfilter *filter, const void* key, uint64_t len) {
     return 1;
 }
 
+/**
+ * Adds a new key to the bloom filter using atomic bit operations.
+ * Two processes adding the same key at the very same time may both
+ * see it as new, any later add sees it as present.
+ * @arg filter The filter to add to
+ * @arg key The key to add
+ * @returns 1 if the key was added, 0 if present.
+ */
+int bf_add_atomic(bloom_bloomfilter *filter, const void* key, uint64_t len) {
+    // Allocate the hash space
+    uint64_t *hashes = alloca(filter->header->k_num * sizeof(uint64_t));
+
+    // Compute the hashes
+    bf_compute_hashes(filter->header->k_num, key, len, hashes);
+
+    uint64_t m = filter->offset;
+    uint64_t offset;
+    uint64_t h;
+    uint32_t i;
+    uint64_t bit;
+    int added = 0;
+
+    for (i=0; i< filter->header->k_num; i++) {
+        h = hashes[i];                                  // Get the hash value
+        offset = 8*sizeof(bloom_filter_header) + i * m; // Get the partition offset
+        bit = offset + (h % m);                         // Compute the bit offset
+        if (!bitmap_test_and_setbit(filter->map, bit)) {
+            added = 1;
+        }
+    }
+
+    if (added) {
+        // The header is packed, address the counter through its offset
+        uint64_t *count = (uint64_t *)((char *)filter->header +
+                offsetof(bloom_filter_header, count));
+        __atomic_add_fetch(count, 1, __ATOMIC_RELAXED);
+    }
+    return added;
+}
+
 /**
  * Checks the filter for a key
  * @arg filter The filter to check
@@ -147,6 +188,23 @@ int bf_contains(bloom_bloomfilter *filter, const void* key, uint64_t len) {
     return bf_internal_contains(filter, hashes);
 }
 
+/**
+ * Removes every key from the filter, keeping its parameters.
+ * @arg filter The filter to clear
+ * @return 0 on success, negative on failure.
+ */
+int bf_clear(bloom_bloomfilter *filter) {
+    if (filter == NULL || filter->map == NULL) {
+        return -1;
+    }
+
+    // Zero the bits but leave the header alone
+    memset(filter->map->mmap + sizeof(bloom_filter_header), 0,
+           filter->map->size - sizeof(bloom_filter_header));
+    filter->header->count = 0;
+    return 0;
+}
+
 /**
  * Returns the size of the bloom filter in item count
  */
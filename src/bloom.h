@@ -60,6 +60,24 @@ int bf_from_bitmap(bloom_bitmap *map, uint32_t k_num, int new_filter, bloom_bloo
  */
 int bf_add(bloom_bloomfilter *filter, const void* key, uint64_t len);
 
+/**
+ * Adds a new key to the bloom filter using atomic bit operations,
+ * so several processes can share one filter without a lock. The
+ * check and the insert are a single step: the key is reported as
+ * present only if every one of its bits was already set.
+ * @arg filter The filter to add to
+ * @arg key The key to add
+ * @returns 1 if the key was added, 0 if present.
+ */
+int bf_add_atomic(bloom_bloomfilter *filter, const void* key, uint64_t len);
+
+/**
+ * Removes every key from the filter, keeping its parameters.
+ * @arg filter The filter to clear
+ * @return 0 on success, negative on failure.
+ */
+int bf_clear(bloom_bloomfilter *filter);
+
 /**
  * Checks the filter for a key
  * @arg filter The filter to check
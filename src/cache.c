@@ -35,6 +35,37 @@
 #include "cache.h"
 #include "utils.h"
 
+/*
+ * Unlinks an entry from the table and the LRU list, then frees it and,
+ * unless keep_data is set, its data.
+ */
+static void
+cache_free_entry(struct cache *cache, struct cache_entry *entry, int keep_data)
+{
+    HASH_DELETE(hh, cache->entries, entry);
+    cork_dllist_remove(&entry->lru);
+    if (!keep_data && entry->data != NULL) {
+        if (cache->free_cb) {
+            cache->free_cb(entry->key, entry->data);
+        } else {
+            ss_free(entry->data);
+        }
+    }
+    ss_free(entry->key);
+    ss_free(entry);
+}
+
+/*
+ * Marks an entry as just used, without touching the hash table.
+ */
+static void
+cache_touch(struct cache *cache, struct cache_entry *entry)
+{
+    entry->ts = ev_time();
+    cork_dllist_remove(&entry->lru);
+    cork_dllist_add(&cache->lru, &entry->lru);
+}
+
 /** Creates a new cache object
  *
  *  @param dst
@@ -62,7 +93,8 @@ cache_create(struct cache **dst, const size_t capacity,
     new->max_entries = capacity;
     new->entries     = NULL;
     new->free_cb     = free_cb;
-    *dst             = new;
+    cork_dllist_init(&new->lru);
+    *dst = new;
     return 0;
 }
 
@@ -79,27 +111,15 @@ cache_create(struct cache **dst, const size_t capacity,
 int
 cache_delete(struct cache *cache, int keep_data)
 {
-    struct cache_entry *entry, *tmp;
+    struct cork_dllist_item *curr, *next;
 
     if (!cache) {
         return EINVAL;
     }
 
-    if (keep_data) {
-        HASH_CLEAR(hh, cache->entries);
-    } else {
-        HASH_ITER(hh, cache->entries, entry, tmp){
-            HASH_DEL(cache->entries, entry);
-            if (entry->data != NULL) {
-                if (cache->free_cb) {
-                    cache->free_cb(entry->key, entry->data);
-                } else {
-                    ss_free(entry->data);
-                }
-            }
-            ss_free(entry->key);
-            ss_free(entry);
-        }
+    cork_dllist_foreach_void(&cache->lru, curr, next) {
+        struct cache_entry *entry = cork_container_of(curr, struct cache_entry, lru);
+        cache_free_entry(cache, entry, keep_data);
     }
 
     ss_free(cache);
@@ -119,7 +139,7 @@ cache_delete(struct cache *cache, int keep_data)
 int
 cache_clear(struct cache *cache, ev_tstamp age)
 {
-    struct cache_entry *entry, *tmp;
+    struct cork_dllist_item *curr, *next;
 
     if (!cache) {
         return EINVAL;
@@ -127,19 +147,13 @@ cache_clear(struct cache *cache, ev_tstamp age)
 
     ev_tstamp now = ev_time();
 
-    HASH_ITER(hh, cache->entries, entry, tmp){
-        if (now - entry->ts > age) {
-            HASH_DEL(cache->entries, entry);
-            if (entry->data != NULL) {
-                if (cache->free_cb) {
-                    cache->free_cb(entry->key, entry->data);
-                } else {
-                    ss_free(entry->data);
-                }
-            }
-            ss_free(entry->key);
-            ss_free(entry);
+    // The oldest entries come first, stop at the first one to keep
+    cork_dllist_foreach_void(&cache->lru, curr, next) {
+        struct cache_entry *entry = cork_container_of(curr, struct cache_entry, lru);
+        if (now - entry->ts <= age) {
+            break;
         }
+        cache_free_entry(cache, entry, 0);
     }
 
     return 0;
@@ -170,16 +184,7 @@ cache_remove(struct cache *cache, char *key, size_t key_len)
     HASH_FIND(hh, cache->entries, key, key_len, tmp);
 
     if (tmp) {
-        HASH_DEL(cache->entries, tmp);
-        if (tmp->data != NULL) {
-            if (cache->free_cb) {
-                cache->free_cb(tmp->key, tmp->data);
-            } else {
-                ss_free(tmp->data);
-            }
-        }
-        ss_free(tmp->key);
-        ss_free(tmp);
+        cache_free_entry(cache, tmp, 0);
     }
 
     return 0;
@@ -217,9 +222,7 @@ cache_lookup(struct cache *cache, char *key, size_t key_len, void *result)
 
     HASH_FIND(hh, cache->entries, key, key_len, tmp);
     if (tmp) {
-        HASH_DELETE(hh, cache->entries, tmp);
-        tmp->ts = ev_time();
-        HASH_ADD_KEYPTR(hh, cache->entries, tmp->key, key_len, tmp);
+        cache_touch(cache, tmp);
         *dirty_hack = tmp->data;
     } else {
         *dirty_hack = result = NULL;
@@ -239,12 +242,8 @@ cache_key_exist(struct cache *cache, char *key, size_t key_len)
 
     HASH_FIND(hh, cache->entries, key, key_len, tmp);
     if (tmp) {
-        HASH_DELETE(hh, cache->entries, tmp);
-        tmp->ts = ev_time();
-        HASH_ADD_KEYPTR(hh, cache->entries, tmp->key, key_len, tmp);
+        cache_touch(cache, tmp);
         return 1;
-    } else {
-        return 0;
     }
 
     return 0;
@@ -269,8 +268,7 @@ cache_key_exist(struct cache *cache, char *key, size_t key_len)
 int
 cache_insert(struct cache *cache, char *key, size_t key_len, void *data)
 {
-    struct cache_entry *entry     = NULL;
-    struct cache_entry *tmp_entry = NULL;
+    struct cache_entry *entry = NULL;
 
     if (!cache) {
         return EINVAL;
@@ -287,21 +285,11 @@ cache_insert(struct cache *cache, char *key, size_t key_len, void *data)
     entry->data = data;
     entry->ts   = ev_time();
     HASH_ADD_KEYPTR(hh, cache->entries, entry->key, key_len, entry);
+    cork_dllist_add(&cache->lru, &entry->lru);
 
     if (HASH_COUNT(cache->entries) >= cache->max_entries) {
-        HASH_ITER(hh, cache->entries, entry, tmp_entry){
-            HASH_DELETE(hh, cache->entries, entry);
-            if (entry->data != NULL) {
-                if (cache->free_cb) {
-                    cache->free_cb(entry->key, entry->data);
-                } else {
-                    ss_free(entry->data);
-                }
-            }
-            ss_free(entry->key);
-            ss_free(entry);
-            break;
-        }
+        struct cork_dllist_item *head = cork_dllist_head(&cache->lru);
+        cache_free_entry(cache, cork_container_of(head, struct cache_entry, lru), 0);
     }
 
     return 0;
@@ -28,6 +28,8 @@
 #ifndef _CACHE_H
 #define _CACHE_H
 
+#include <libcork/ds.h>
+
 #include "uthash.h"
 #include "ev.h"
 
@@ -39,14 +41,21 @@ struct cache_entry {
     void *data;        /**<Payload */
     ev_tstamp ts;    /**<Timestamp */
     UT_hash_handle hh; /**<Hash Handle for uthash */
+    struct cork_dllist_item lru; /**<Position in the LRU list */
 };
 
 /**
  * A cache object
+ *
+ * Entries are kept on a list from the least to the most recently used.
+ * A touched entry gets the current timestamp and moves to the tail, so the
+ * list is also sorted by age: eviction takes the head, and expiry stops at
+ * the first entry young enough to stay.
  */
 struct cache {
     size_t max_entries;              /**<Amount of entries this cache object can hold */
     struct cache_entry *entries;     /**<Head pointer for uthash */
+    struct cork_dllist lru;          /**<Entries, least recently used first */
     void (*free_cb) (void *key, void *element); /**<Callback function to free cache entries */
 };
 
@@ -39,7 +39,7 @@ int init_udprelay(const char *server_host, const char *server_port,
                   const ss_addr_t tunnel_addr,
 #endif
 #endif
-                  int mtu, crypto_t *crypto, int timeout, const char *iface);
+                  int mtu, int offload, crypto_t *crypto, int timeout, const char *iface);
 
 void free_udprelay(void);
 
@@ -66,7 +66,14 @@ enum {
     GETOPT_VAL_MPTCP,
     GETOPT_VAL_PASSWORD,
     GETOPT_VAL_MANAGER_ADDRESS,
-    GETOPT_VAL_EXECUTABLE
+    GETOPT_VAL_EXECUTABLE,
+    GETOPT_VAL_WORKERS,
+    GETOPT_VAL_BUFFER_SIZE,
+    GETOPT_VAL_REPLAY_WINDOW,
+    GETOPT_VAL_REPLAY_FILE,
+    GETOPT_VAL_UDP_OFFLOAD,
+    GETOPT_VAL_UDP_POOL,
+    GETOPT_VAL_BENCH_CIPHERS
 };
 
 #endif // _COMMON_H
@@ -32,6 +32,12 @@
 #endif
 
 #include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <sodium.h>
 #include <mbedtls/md5.h>
 
@@ -39,27 +45,337 @@
 #include "stream.h"
 #include "aead.h"
 #include "utils.h"
-#include "sbf.h"
+#include "bloom.h"
+#include "bbf.h"
 
-static bloom_sbf g_sbf;
+/*
+ * Salts and IVs are remembered in a ring of FS_BF_GENERATIONS fixed size
+ * bloom filters. New keys go into the current generation and lookups check
+ * all of them. fs_sbf_expire() recycles the oldest generation as the new
+ * current one, but never before the replay window has passed over its
+ * last key, so a key is remembered for at least the window and memory stays
+ * bounded. AEAD salts are only added once a chunk authenticates.
+ *
+ * With several worker processes, the filters and the ring index live in
+ * MAP_SHARED memory set up before fork() and keys are inserted with atomic
+ * bit operations.
+ *
+ * Unless FS_BF_BLOCKED is 0, every generation is a blocked filter, so a
+ * lookup costs one cache miss per generation instead of k_num of them.
+ *
+ * With a replay file, the ring lives in that file and every generation in
+ * a file next to it, all mapped with MAP_SHARED. The kernel writes back
+ * the dirty pages, fs_sbf_flush() forces it, and a restarted server maps
+ * the same files again instead of starting with empty filters.
+ */
+#define FS_SBF_MAGIC ((uint32_t)0xF5B10F5D)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t generations;
+    uint64_t bytes;         // size of each generation
+    uint32_t blocked;
+    uint32_t current;       // generation taking new keys
+    int64_t started_at[FS_BF_GENERATIONS]; // when each became current, 0 if never
+} fs_sbf_ring_t;
+
+static int g_sbf_shared = 0;
+static const char *g_sbf_path = NULL;
+static int g_sbf_window = FS_BF_REPLAY_WINDOW;
+static int g_sbf_blocked = FS_BF_BLOCKED;
+static fs_sbf_ring_t *g_sbf_ring = NULL;
+static bloom_bitmap g_sbf_maps[FS_BF_GENERATIONS];
+static bloom_bloomfilter g_sbf_filters[FS_BF_GENERATIONS];
+static bloom_bbf g_sbf_blocks[FS_BF_GENERATIONS];
+static uint64_t g_sbf_capacity;
+
+void fs_sbf_set_shared(int shared) {
+    g_sbf_shared = shared;
+}
+
+void fs_sbf_set_window(int window) {
+    g_sbf_window = window;
+}
+
+void fs_sbf_set_path(const char *path) {
+    g_sbf_path = path;
+}
+
+/*
+ * Maps the ring from g_sbf_path. Returns 1 if it holds filters built with
+ * the same parameters, 0 if it was (re)initialized, negative on error.
+ */
+static int fs_sbf_map_ring(bloom_filter_params *params) {
+    struct stat st;
+    int loaded = 0;
+    int fd = open(g_sbf_path, O_RDWR | O_CREAT, 0600);
+    if (fd == -1 || fstat(fd, &st) != 0) {
+        ERROR("fs_sbf_map_ring");
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+
+    if (st.st_size == sizeof(fs_sbf_ring_t)) {
+        fs_sbf_ring_t ring;
+        if (pread(fd, &ring, sizeof(ring), 0) == sizeof(ring)
+            && ring.magic == FS_SBF_MAGIC
+            && ring.generations == FS_BF_GENERATIONS
+            && ring.bytes == params->bytes
+            && ring.blocked == (uint32_t)g_sbf_blocked
+            && ring.current < FS_BF_GENERATIONS)
+            loaded = 1;
+    }
+    if (!loaded && (ftruncate(fd, 0) != 0
+                    || ftruncate(fd, sizeof(fs_sbf_ring_t)) != 0)) {
+        ERROR("fs_sbf_map_ring");
+        close(fd);
+        return -1;
+    }
+
+    g_sbf_ring = mmap(NULL, sizeof(fs_sbf_ring_t), PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+    close(fd);
+    if (g_sbf_ring == MAP_FAILED) {
+        g_sbf_ring = NULL;
+        return -1;
+    }
+    return loaded;
+}
+
+/*
+ * Maps generation i, from its own file next to the ring if there is one.
+ * Returns 1 if the file holds a generation of the loaded ring, 0 if the
+ * generation starts empty, negative on error. A missing or truncated file
+ * is started over rather than failing the whole ring.
+ */
+static int fs_sbf_map_generation(int i, uint64_t bytes, int loaded) {
+    char path[PATH_MAX];
+    struct stat st;
+    int fd, res;
+
+    if (g_sbf_path == NULL)
+        return bitmap_from_file(-1, bytes,
+                                g_sbf_shared ? SHARED_ANONYMOUS : ANONYMOUS,
+                                &g_sbf_maps[i]);
+
+    snprintf(path, sizeof(path), "%s.%d", g_sbf_path, i);
+    fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd == -1 || fstat(fd, &st) != 0) {
+        ERROR("fs_sbf_map_generation");
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+
+    // stale filters may have another size, start them over
+    if (!loaded || (uint64_t)st.st_size != bytes) {
+        if (loaded)
+            LOGE("salt filter %s is damaged, starting it over", path);
+        if (ftruncate(fd, 0) != 0 || ftruncate(fd, bytes) != 0) {
+            ERROR("fs_sbf_map_generation");
+            close(fd);
+            return -1;
+        }
+        loaded = 0;
+    }
+
+    res = bitmap_from_file(fd, bytes, SHARED, &g_sbf_maps[i]);
+    close(fd);
+    if (res != 0)
+        return res;
+    return loaded;
+}
+
+/*
+ * Sets up the filter of generation i on its mapped bitmap, starting it
+ * over if a loaded one does not check out.
+ */
+static int fs_sbf_load_generation(int i, uint32_t k_num, int loaded) {
+    int res;
+
+    if (loaded) {
+        if (g_sbf_blocked)
+            res = bbf_from_bitmap(&g_sbf_maps[i], 0, &g_sbf_blocks[i]);
+        else
+            res = bf_from_bitmap(&g_sbf_maps[i], k_num, 0, &g_sbf_filters[i]);
+        if (res == 0)
+            return 0;
+        LOGE("salt filter generation %d is damaged, starting it over", i);
+        memset(g_sbf_maps[i].mmap, 0, g_sbf_maps[i].size);
+    }
+
+    if (g_sbf_blocked)
+        return bbf_from_bitmap(&g_sbf_maps[i], 1, &g_sbf_blocks[i]);
+    return bf_from_bitmap(&g_sbf_maps[i], k_num, 1, &g_sbf_filters[i]);
+}
 
 int fs_sbf_init() {
-    bloom_sbf_params params = SBF_DEFAULT_PARAMS;
-    params.initial_capacity = FS_BF_ENTRIES__SERVER;
-    params.fp_probability = FS_BF_ERR_RATE__SERVER;
-    return sbf_from_filters(&params, NULL, NULL, 0, NULL, &g_sbf);
+    int i, res, loaded = 0;
+    bloom_filter_params params = { 0, 0, FS_BF_ENTRIES__SERVER, FS_BF_ERR_RATE__SERVER };
+    if (g_sbf_blocked)
+        res = bbf_params_for_capacity(&params);
+    else
+        res = bf_params_for_capacity(&params);
+    if (res != 0)
+        return res;
+
+    if (g_sbf_path != NULL) {
+        if ((loaded = fs_sbf_map_ring(&params)) < 0)
+            return loaded;
+    } else {
+        g_sbf_ring = mmap(NULL, sizeof(fs_sbf_ring_t), PROT_READ | PROT_WRITE,
+                          MAP_ANON | (g_sbf_shared ? MAP_SHARED : MAP_PRIVATE), -1, 0);
+        if (g_sbf_ring == MAP_FAILED) {
+            g_sbf_ring = NULL;
+            return -1;
+        }
+    }
+    g_sbf_capacity = params.capacity;
+
+    for (i = 0; i < FS_BF_GENERATIONS; i++) {
+        res = fs_sbf_map_generation(i, params.bytes, loaded);
+        if (res < 0)
+            return res;
+        res = fs_sbf_load_generation(i, params.k_num, res);
+        if (res != 0)
+            return res;
+    }
+
+    if (loaded) {
+        LOGI("loaded the salt filter from %s", g_sbf_path);
+    } else {
+        g_sbf_ring->generations = FS_BF_GENERATIONS;
+        g_sbf_ring->bytes       = params.bytes;
+        g_sbf_ring->blocked     = g_sbf_blocked;
+        g_sbf_ring->current     = 0;
+        memset(g_sbf_ring->started_at, 0, sizeof(g_sbf_ring->started_at));
+        g_sbf_ring->started_at[0] = time(NULL);
+        g_sbf_ring->magic       = FS_SBF_MAGIC;
+    }
+
+    return 0;
+}
+
+static inline uint32_t fs_sbf_current() {
+    return __atomic_load_n(&g_sbf_ring->current, __ATOMIC_ACQUIRE);
+}
+
+static int fs_sbf_gen_contains(uint32_t gen, const void *buffer, int len) {
+    if (g_sbf_blocked)
+        return bbf_contains(&g_sbf_blocks[gen], buffer, len);
+    return bf_contains(&g_sbf_filters[gen], buffer, len);
+}
+
+static uint64_t fs_sbf_gen_size(uint32_t gen) {
+    if (g_sbf_blocked)
+        return bbf_size(&g_sbf_blocks[gen]);
+    return bf_size(&g_sbf_filters[gen]);
+}
+
+static int fs_sbf_add_current(const void *buffer, int len) {
+    uint32_t current = fs_sbf_current();
+    if (g_sbf_blocked) {
+        if (g_sbf_shared)
+            return bbf_add_atomic(&g_sbf_blocks[current], buffer, len);
+        return bbf_add(&g_sbf_blocks[current], buffer, len);
+    }
+    if (g_sbf_shared)
+        return bf_add_atomic(&g_sbf_filters[current], buffer, len);
+    return bf_add(&g_sbf_filters[current], buffer, len);
 }
 
 int fs_sbf_add(const void *buffer, int len) {
-    return sbf_add(&g_sbf, buffer, len);
+    return fs_sbf_add_current(buffer, len);
 }
 
 int fs_sbf_check(const void *buffer, int len) {
-    return sbf_contains(&g_sbf, buffer, len);
+    uint32_t i;
+    for (i = 0; i < FS_BF_GENERATIONS; i++) {
+        if (fs_sbf_gen_contains(i, buffer, len) == 1)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Returns 1 if the key was seen before, 0 if it has just been added,
+ * negative on error. In the current generation, checking and adding
+ * is a single atomic step between workers.
+ */
+int fs_sbf_check_and_add(const void *buffer, int len) {
+    int res;
+    uint32_t i, current = fs_sbf_current();
+    for (i = 0; i < FS_BF_GENERATIONS; i++) {
+        if (i != current && fs_sbf_gen_contains(i, buffer, len) == 1)
+            return 1;
+    }
+    res = fs_sbf_add_current(buffer, len);
+    return res < 0 ? res : !res;
+}
+
+/*
+ * Retire the oldest generation once the current one is older than its share
+ * of the replay window, or once it is full. Either way, the oldest one is
+ * kept until the last of its keys is older than the window, i.e. until the
+ * generation after it became current at least a window ago; a full current
+ * one then only raises the false positive rate. Only one process may call
+ * this. Returns 1 if the filters were rotated.
+ */
+int fs_sbf_expire(time_t now) {
+    uint32_t current = fs_sbf_current();
+    uint32_t next    = (current + 1) % FS_BF_GENERATIONS;
+    time_t interval  = max(g_sbf_window / (FS_BF_GENERATIONS - 1), 1);
+
+    if (now - g_sbf_ring->started_at[current] < interval
+        && fs_sbf_gen_size(current) < g_sbf_capacity)
+        return 0;
+    if (g_sbf_ring->started_at[next] != 0
+        && now - g_sbf_ring->started_at[(next + 1) % FS_BF_GENERATIONS] < g_sbf_window)
+        return 0;
+
+    if (g_sbf_blocked)
+        bbf_clear(&g_sbf_blocks[next]);
+    else
+        bf_clear(&g_sbf_filters[next]);
+    g_sbf_ring->started_at[next] = now;
+    __atomic_store_n(&g_sbf_ring->current, next, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/*
+ * Writes the filters back to the replay file, a no-op without one.
+ */
+int fs_sbf_flush() {
+    int i, res = 0;
+    if (g_sbf_ring == NULL)
+        return -1;
+    if (g_sbf_path == NULL)
+        return 0;
+    for (i = 0; i < FS_BF_GENERATIONS; i++) {
+        if (g_sbf_blocked)
+            res |= bbf_flush(&g_sbf_blocks[i]);
+        else
+            res |= bf_flush(&g_sbf_filters[i]);
+    }
+    if (msync(g_sbf_ring, sizeof(fs_sbf_ring_t), MS_SYNC) != 0)
+        res = -1;
+    return res;
 }
 
 int fs_sbf_close() {
-    return sbf_close(&g_sbf);
+    int i, res = 0;
+    if (g_sbf_ring == NULL)
+        return -1;
+    for (i = 0; i < FS_BF_GENERATIONS; i++) {
+        if (g_sbf_blocked)
+            res |= bbf_close(&g_sbf_blocks[i]);
+        else
+            res |= bf_close(&g_sbf_filters[i]);
+    }
+    munmap(g_sbf_ring, sizeof(fs_sbf_ring_t));
+    g_sbf_ring = NULL;
+    return res;
 }
 
 int
@@ -107,6 +423,68 @@ bprepend(buffer_t *dst, buffer_t *src, size_t capacity)
     return dst->len;
 }
 
+/*
+ * Gather what is left of a vectored ciphertext, skipping the first ofst
+ * bytes already sent, into dst. The iovecs may point into dst itself: such
+ * pieces are moved in place, the others (the headers in src->hdr) copied
+ * in last. The pieces inside dst are in wire order and only ever get more
+ * headers in front of them, so the shift grows from one to the next: those
+ * moving down are moved first to last, those moving up last to first, and
+ * none overwrites a piece not moved yet.
+ */
+int
+bcollect(buffer_t *dst, const cipher_iov_t *src, size_t ofst, size_t capacity)
+{
+    const char *ext[CRYPTO_IOV_MAX];
+    size_t from[CRYPTO_IOV_MAX];
+    size_t to[CRYPTO_IOV_MAX];
+    size_t len[CRYPTO_IOV_MAX];
+    size_t total = 0;
+    int i, n = 0;
+
+    for (i = 0; i < src->iovcnt; i++) {
+        const char *base = src->iov[i].iov_base;
+        size_t l         = src->iov[i].iov_len;
+        if (ofst >= l) {
+            ofst -= l;
+            continue;
+        }
+        base += ofst;
+        l    -= ofst;
+        ofst  = 0;
+
+        if (dst->data != NULL && base >= dst->data
+            && base < dst->data + dst->capacity) {
+            ext[n]  = NULL;
+            from[n] = base - dst->data;
+        } else {
+            ext[n]  = base;
+            from[n] = 0;
+        }
+        to[n]  = total;
+        len[n] = l;
+        total += l;
+        n++;
+    }
+
+    // may move the buffer, the pieces inside it are known by offset
+    brealloc(dst, total, capacity);
+
+    for (i = 0; i < n; i++)
+        if (ext[i] == NULL && to[i] < from[i])
+            memmove(dst->data + to[i], dst->data + from[i], len[i]);
+    for (i = n - 1; i >= 0; i--)
+        if (ext[i] == NULL && to[i] > from[i])
+            memmove(dst->data + to[i], dst->data + from[i], len[i]);
+    for (i = 0; i < n; i++)
+        if (ext[i] != NULL)
+            memcpy(dst->data + to[i], ext[i], len[i]);
+
+    dst->idx = 0;
+    dst->len = total;
+    return dst->len;
+}
+
 int
 rand_bytes(void *output, int len)
 {
@@ -145,6 +523,87 @@ entropy_check(void)
 #endif
 }
 
+static double
+bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Seals full TCP chunks with a new session of the AEAD cipher for about
+ * the given time, through aead_encrypt() like the relay does, and returns
+ * the plaintext throughput in MB/s, or a negative value on error.
+ */
+double
+crypto_bench_method(const char *method, double seconds)
+{
+    int i, m = -1;
+    size_t bytes = 0;
+    double start, elapsed = 0;
+    buffer_t buf;
+    cipher_ctx_t ctx;
+
+    for (i = 0; i < AEAD_CIPHER_NUM; i++)
+        if (strcmp(method, supported_aead_ciphers[i]) == 0) {
+            m = i;
+            break;
+        }
+    if (m == -1)
+        return -1;
+
+    cipher_t *cipher = aead_init("fuckshadows-bench", method);
+    if (cipher == NULL)
+        return -1;
+    aead_ctx_init(cipher, &ctx, 1);
+    balloc(&buf, CRYPTO_HEADROOM + CRYPTO_BENCH_CHUNK + CRYPTO_TAILROOM);
+    memset(buf.data, 0x5a, buf.capacity);
+
+    start = bench_now();
+    do {
+        // check the clock every 16 chunks only
+        for (i = 0; i < 16; i++) {
+            buf.idx = CRYPTO_HEADROOM;
+            buf.len = CRYPTO_BENCH_CHUNK;
+            if (aead_encrypt(&buf, &ctx, buf.capacity) != CRYPTO_OK) {
+                bytes = 0;
+                goto out;
+            }
+            bytes += CRYPTO_BENCH_CHUNK;
+        }
+        elapsed = bench_now() - start;
+    } while (elapsed < seconds);
+
+out:
+    bfree(&buf);
+    aead_ctx_release(&ctx);
+    aead_release(cipher);
+    return bytes == 0 ? -1 : bytes / elapsed / 1e6;
+}
+
+/*
+ * Prints the throughput of every AEAD cipher on this CPU.
+ */
+void
+crypto_bench_ciphers(double seconds)
+{
+    int i;
+
+    if (sodium_init() == -1) {
+        FATAL("Failed to initialize sodium");
+    }
+
+    printf("%-24s %10s\n", "cipher", "MB/s");
+    for (i = 0; i < AEAD_CIPHER_NUM; i++) {
+        double mbps = crypto_bench_method(supported_aead_ciphers[i], seconds);
+        if (mbps < 0)
+            printf("%-24s %10s\n", supported_aead_ciphers[i], "n/a");
+        else
+            printf("%-24s %10.1f\n", supported_aead_ciphers[i], mbps);
+    }
+}
+
 crypto_t *
 crypto_init(const char *password, const char *method)
 {
@@ -179,6 +638,7 @@ crypto_init(const char *password, const char *method)
                 .decrypt_all = &stream_decrypt_all,
                 .encrypt     = &stream_encrypt,
                 .decrypt     = &stream_decrypt,
+                .encrypt_iov = &stream_encrypt_iov,
                 .ctx_init    = &stream_ctx_init,
                 .ctx_release = &stream_ctx_release,
             };
@@ -202,6 +662,7 @@ crypto_init(const char *password, const char *method)
                 .decrypt_all = &aead_decrypt_all,
                 .encrypt     = &aead_encrypt,
                 .decrypt     = &aead_decrypt,
+                .encrypt_iov = &aead_encrypt_iov,
                 .ctx_init    = &aead_ctx_init,
                 .ctx_release = &aead_ctx_release,
             };
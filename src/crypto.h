@@ -24,9 +24,11 @@
 #define _CRYPTO_H
 
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <time.h>
 
 #ifdef HAVE_STDINT_H
 #include <stdint.h>
@@ -42,6 +44,7 @@ typedef mbedtls_cipher_context_t cipher_evp_t;
 typedef mbedtls_md_info_t digest_type_t;
 #define MAX_KEY_LENGTH 64
 #define MAX_NONCE_LENGTH 32
+#define MAX_TAG_LENGTH 16
 #define MAX_MD_SIZE MBEDTLS_MD_MAX_SIZE
 
 /* we must have MBEDTLS_CIPHER_MODE_CFB defined */
@@ -82,6 +85,40 @@ typedef mbedtls_md_info_t digest_type_t;
 #define FS_BF_ERR_RATE__SERVER 1e-6
 #endif
 
+/*
+ * salt filter generations and replay window in seconds. A salt is remembered
+ * for at least the window: a full generation only makes the filter report
+ * more false positives until its time has come.
+ */
+#ifndef FS_BF_GENERATIONS
+#define FS_BF_GENERATIONS 3
+#endif
+
+#ifndef FS_BF_REPLAY_WINDOW
+#define FS_BF_REPLAY_WINDOW 3600
+#endif
+
+/* seconds between two flushes of the salt filter to its replay file */
+#ifndef FS_BF_FLUSH_INTERVAL
+#define FS_BF_FLUSH_INTERVAL 60
+#endif
+
+/* use cache line blocked filters (bbf.h), 0 for the classic partitioned ones */
+#ifndef FS_BF_BLOCKED
+#define FS_BF_BLOCKED 1
+#endif
+
+/*
+ * Ciphers are timed sealing CRYPTO_BENCH_CHUNK byte chunks, the largest
+ * a TCP chunk can carry.
+ */
+#define CRYPTO_BENCH_CHUNK 0x3FFF
+
+/* seconds spent on every cipher by --bench-ciphers */
+#ifndef CRYPTO_BENCH_TIME
+#define CRYPTO_BENCH_TIME 1.0
+#endif
+
 /*
 #ifndef FS_BF_ENTRIES__CLIENT
 #define FS_BF_ENTRIES__CLIENT 1e4
@@ -106,12 +143,15 @@ typedef struct {
     size_t key_len;
     size_t tag_len;
     uint8_t key[MAX_KEY_LENGTH];
+    crypto_aead_aes256gcm_state *aes_gcm; // master key schedule, NULL unless AES-NI is used
 } cipher_t;
 
 typedef struct {
     uint32_t init;
     uint64_t counter;
     cipher_evp_t *evp;
+    crypto_aead_aes256gcm_state *aes_gcm; // replaces evp when cipher->aes_gcm is set
+    uint32_t salt_added;                  // AEAD: salt in the replay filter
     cipher_t *cipher;
     buffer_t *chunk;
     uint8_t salt[MAX_KEY_LENGTH];
@@ -119,6 +159,31 @@ typedef struct {
     uint8_t nonce[MAX_NONCE_LENGTH];
 } cipher_ctx_t;
 
+/*
+ * TCP encrypt() reads the plaintext from data + idx and seals it in place
+ * when idx leaves enough headroom for the salt and the first chunk header.
+ * On return, the ciphertext starts at data + idx. Reserving CRYPTO_HEADROOM
+ * bytes in front of the payload and CRYPTO_TAILROOM behind it saves a copy.
+ */
+#define CRYPTO_HEADROOM (MAX_KEY_LENGTH + 2 + MAX_TAG_LENGTH) // salt, length, tag
+#define CRYPTO_TAILROOM MAX_TAG_LENGTH
+
+/*
+ * Vectored TCP encrypt() leaves the sealed payload where it lies and puts
+ * the salt, the chunk lengths and the tags into hdr, so the whole batch of
+ * chunks can be handed to writev() as iov. One call covers up to
+ * CRYPTO_IOV_CHUNKS full chunks, i.e. a little less than 128KB.
+ */
+#define CRYPTO_IOV_CHUNKS 8
+#define CRYPTO_IOV_MAX    (2 * CRYPTO_IOV_CHUNKS + 1)
+
+typedef struct {
+    int iovcnt;
+    size_t len;
+    struct iovec iov[CRYPTO_IOV_MAX];
+    uint8_t hdr[MAX_KEY_LENGTH + CRYPTO_IOV_CHUNKS * (2 + 2 * MAX_TAG_LENGTH)];
+} cipher_iov_t;
+
 typedef struct crypto {
     cipher_t *cipher;
 
@@ -126,6 +191,7 @@ typedef struct crypto {
     int(*const decrypt_all)(buffer_t *, cipher_t *, size_t);
     int(*const encrypt)(buffer_t *, cipher_ctx_t *, size_t);
     int(*const decrypt)(buffer_t *, cipher_ctx_t *, size_t);
+    int(*const encrypt_iov)(buffer_t *, cipher_ctx_t *, cipher_iov_t *, size_t);
 
     void(*const ctx_init)(cipher_t *, cipher_ctx_t *, int);
     void(*const ctx_release)(cipher_ctx_t *);
@@ -134,10 +200,13 @@ typedef struct crypto {
 int balloc(buffer_t *ptr, size_t capacity);
 int brealloc(buffer_t *ptr, size_t len, size_t capacity);
 int bprepend(buffer_t *dst, buffer_t *src, size_t capacity);
+int bcollect(buffer_t *dst, const cipher_iov_t *src, size_t ofst, size_t capacity);
 void bfree(buffer_t *ptr);
 int rand_bytes(void *output, int len);
 
 crypto_t *crypto_init(const char *password, const char *method);
+double crypto_bench_method(const char *method, double seconds);
+void crypto_bench_ciphers(double seconds);
 unsigned char *crypto_md5(const unsigned char *d, size_t n,
                           unsigned char *md);
 
@@ -148,9 +217,15 @@ extern const char *supported_aead_ciphers[];
 void dump(char *tag, char *text, int len);
 
 
+void fs_sbf_set_shared(int shared);
+void fs_sbf_set_window(int window);
+void fs_sbf_set_path(const char *path);
 int fs_sbf_init();
 int fs_sbf_add(const void *buffer, int len);
 int fs_sbf_check(const void *buffer, int len);
+int fs_sbf_check_and_add(const void *buffer, int len);
+int fs_sbf_expire(time_t now);
+int fs_sbf_flush();
 int fs_sbf_close();
 
 #endif // _CRYPTO_H
@@ -249,6 +249,28 @@ read_jconf(const char *file)
                 check_json_value_type(value, json_boolean,
                                       "invalid config file: option 'ipv6_first' must be a boolean");
                 conf.ipv6_first = value->u.boolean;
+            } else if (strcmp(name, "buffer_size") == 0) {
+                check_json_value_type(value, json_integer,
+                                      "invalid config file: option 'buffer_size' must be an integer");
+                conf.buffer_size = value->u.integer;
+            } else if (strcmp(name, "workers") == 0) {
+                check_json_value_type(value, json_integer,
+                                      "invalid config file: option 'workers' must be an integer");
+                conf.workers = value->u.integer;
+            } else if (strcmp(name, "replay_window") == 0) {
+                check_json_value_type(value, json_integer,
+                                      "invalid config file: option 'replay_window' must be an integer");
+                conf.replay_window = value->u.integer;
+            } else if (strcmp(name, "replay_file") == 0) {
+                conf.replay_file = to_string(value);
+            } else if (strcmp(name, "udp_offload") == 0) {
+                check_json_value_type(value, json_boolean,
+                                      "invalid config file: option 'udp_offload' must be a boolean");
+                conf.udp_offload = value->u.boolean;
+            } else if (strcmp(name, "udp_pool") == 0) {
+                check_json_value_type(value, json_integer,
+                                      "invalid config file: option 'udp_pool' must be an integer");
+                conf.udp_pool = value->u.integer;
 #ifdef HAS_SYSLOG
             } else if (strcmp(name, "use_syslog") == 0) {
                 check_json_value_type(value, json_boolean,
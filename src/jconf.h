@@ -29,6 +29,8 @@
 #define MAX_CONNECT_TIMEOUT 10
 #define MAX_REQUEST_TIMEOUT 60
 #define MIN_UDP_TIMEOUT 10
+#define MIN_BUF_SIZE 2048
+#define MAX_BUF_SIZE 65536
 
 #define TCP_ONLY     0
 #define TCP_AND_UDP  1
@@ -64,6 +66,12 @@ typedef struct {
     int mtu;
     int mptcp;
     int ipv6_first;
+    int workers;
+    int buffer_size;
+    int replay_window;
+    char *replay_file;
+    int udp_offload;
+    int udp_pool;
 } jconf_t;
 
 jconf_t *read_jconf(const char *file);
@@ -100,6 +100,7 @@ static int ipv6first = 0;
 static int fast_open = 0;
 static int udp_fd    = 0;
 static int no_delay  = 0;
+static int buf_size  = BUF_SIZE;
 
 static struct ev_signal sigint_watcher;
 static struct ev_signal sigterm_watcher;
@@ -144,6 +145,77 @@ setnonblocking(int fd)
     return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 }
 
+#ifdef USE_SPLICE
+/*
+ * Direct connections carry plaintext, so once the remote is connected the
+ * bytes can go socket to pipe to socket without a copy to userspace.
+ */
+static int
+splice_start(remote_t *remote)
+{
+    if (pipe2(remote->up, O_NONBLOCK | O_CLOEXEC) == -1) {
+        return -1;
+    }
+    if (pipe2(remote->down, O_NONBLOCK | O_CLOEXEC) == -1) {
+        close(remote->up[0]);
+        close(remote->up[1]);
+        return -1;
+    }
+    remote->splice   = 1;
+    remote->up_len   = 0;
+    remote->down_len = 0;
+    return 0;
+}
+
+static void
+splice_stop(remote_t *remote)
+{
+    if (remote->splice) {
+        close(remote->up[0]);
+        close(remote->up[1]);
+        close(remote->down[0]);
+        close(remote->down[1]);
+        remote->splice = 0;
+    }
+}
+
+/*
+ * Fill the pipe from fd unless it still holds data, then flush it into to.
+ * Pass from == -1 to flush only. Returns 0 on EOF, -1 on error and 1
+ * otherwise, *len is what is left in the pipe.
+ */
+static int
+splice_relay(int from, int to, int *pipefd, size_t *len)
+{
+    ssize_t s;
+
+    if (from != -1 && *len == 0) {
+        s = splice(from, NULL, pipefd[1], NULL, buf_size,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (s == 0) {
+            return 0;
+        } else if (s == -1) {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+        }
+        *len = s;
+    }
+
+    while (*len > 0) {
+        s = splice(pipefd[0], NULL, to, NULL, *len,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (s == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else if (s <= 0) {
+            return -1;
+        }
+        *len -= s;
+    }
+
+    return 1;
+}
+
+#endif
+
 int
 create_and_bind(const char *addr, const char *port)
 {
@@ -261,8 +333,27 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
     buffer_t *buf;
     ssize_t r;
 
+    static cipher_iov_t civ;
+
     ev_timer_stop(EV_A_ & server->delayed_connect_watcher);
 
+#ifdef USE_SPLICE
+    if (remote != NULL && remote->splice) {
+        int ret = splice_relay(server->fd, remote->fd, remote->up, &remote->up_len);
+        if (ret != 1) {
+            if (ret == -1 && verbose)
+                ERROR("server_recv_cb_splice");
+            close_and_free_remote(EV_A_ remote);
+            close_and_free_server(EV_A_ server);
+        } else if (remote->up_len > 0) {
+            // the remote is slow, wait for send
+            ev_io_stop(EV_A_ & server_recv_ctx->io);
+            ev_io_start(EV_A_ & remote->send_ctx->io);
+        }
+        return;
+    }
+#endif
+
     if (remote == NULL) {
         buf = server->buf;
     } else {
@@ -270,7 +361,7 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
     }
 
     if (revents != EV_TIMER) {
-        r = recv(server->fd, buf->data + buf->len, BUF_SIZE - buf->len, 0);
+        r = recv(server->fd, buf->data + buf->len, buf_size - buf->len, 0);
 
         if (r == 0) {
             // connection closed
@@ -302,12 +393,20 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
                 return;
             }
 
+            civ.iovcnt = 0;
+
             // insert shadowsocks header
             if (!remote->direct) {
 #ifdef ANDROID
                 tx += remote->buf->len;
 #endif
-                int err = crypto->encrypt(remote->buf, server->e_ctx, BUF_SIZE);
+                int err;
+                if (remote->send_ctx->connected && server->abuf == NULL) {
+                    // seal all chunks in place and send them with one writev()
+                    err = crypto->encrypt_iov(remote->buf, server->e_ctx, &civ, buf_size);
+                } else {
+                    err = crypto->encrypt(remote->buf, server->e_ctx, buf_size);
+                }
 
                 if (err) {
                     LOGE("invalid password or cipher");
@@ -317,7 +416,7 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
                 }
 
                 if (server->abuf) {
-                    bprepend(remote->buf, server->abuf, BUF_SIZE);
+                    bprepend(remote->buf, server->abuf, buf_size);
                     bfree(server->abuf);
                     ss_free(server->abuf);
                     server->abuf = NULL;
@@ -420,11 +519,18 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
                     }
                 }
             } else {
-                int s = send(remote->fd, remote->buf->data, remote->buf->len, 0);
+                if (civ.iovcnt == 0) {
+                    civ.iov[0].iov_base = remote->buf->data;
+                    civ.iov[0].iov_len  = remote->buf->len;
+                    civ.iovcnt          = 1;
+                    civ.len             = remote->buf->len;
+                }
+
+                ssize_t s = writev(remote->fd, civ.iov, civ.iovcnt);
                 if (s == -1) {
                     if (errno == EAGAIN || errno == EWOULDBLOCK) {
                         // no data, wait for send
-                        remote->buf->idx = 0;
+                        bcollect(remote->buf, &civ, 0, buf_size);
                         ev_io_stop(EV_A_ & server_recv_ctx->io);
                         ev_io_start(EV_A_ & remote->send_ctx->io);
                         return;
@@ -434,9 +540,8 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
                         close_and_free_server(EV_A_ server);
                         return;
                     }
-                } else if (s < (int)(remote->buf->len)) {
-                    remote->buf->len -= s;
-                    remote->buf->idx  = s;
+                } else if (s < (ssize_t)civ.len) {
+                    bcollect(remote->buf, &civ, s, buf_size);
                     ev_io_stop(EV_A_ & server_recv_ctx->io);
                     ev_io_start(EV_A_ & remote->send_ctx->io);
                     return;
@@ -646,7 +751,7 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
                 else if (dst_port == tls_protocol->default_port)
                     ret = tls_protocol->parse_packet(buf->data + 3 + abuf->len,
                                                      buf->len - 3 - abuf->len, &hostname);
-                if (ret == -1 && buf->len < BUF_SIZE && server->stage != STAGE_SNI) {
+                if (ret == -1 && buf->len < buf_size && server->stage != STAGE_SNI) {
                     server->stage = STAGE_SNI;
                     ev_timer_start(EV_A_ & server->delayed_connect_watcher);
                     return;
@@ -765,7 +870,7 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
             }
 
             if (!remote->direct) {
-                int err = crypto->encrypt(abuf, server->e_ctx, BUF_SIZE);
+                int err = crypto->encrypt(abuf, server->e_ctx, buf_size);
                 if (err) {
                     LOGE("invalid password or cipher");
                     close_and_free_remote(EV_A_ remote);
@@ -799,6 +904,19 @@ server_send_cb(EV_P_ ev_io *w, int revents)
     server_ctx_t *server_send_ctx = (server_ctx_t *)w;
     server_t *server              = server_send_ctx->server;
     remote_t *remote              = server->remote;
+#ifdef USE_SPLICE
+    if (remote != NULL && remote->splice && remote->down_len > 0) {
+        if (splice_relay(-1, server->fd, remote->down, &remote->down_len) == -1) {
+            ERROR("server_send_cb_splice");
+            close_and_free_remote(EV_A_ remote);
+            close_and_free_server(EV_A_ server);
+        } else if (remote->down_len == 0) {
+            ev_io_stop(EV_A_ & server_send_ctx->io);
+            ev_io_start(EV_A_ & remote->recv_ctx->io);
+        }
+        return;
+    }
+#endif
     if (server->buf->len == 0) {
         // close and free
         close_and_free_remote(EV_A_ remote);
@@ -861,6 +979,18 @@ remote_timeout_cb(EV_P_ ev_timer *watcher, int revents)
     close_and_free_server(EV_A_ server);
 }
 
+static void
+first_response_sent(server_t *server, remote_t *remote)
+{
+    // Disable TCP_NODELAY after the first response are sent
+    if (!remote->recv_ctx->connected && !no_delay) {
+        int opt = 0;
+        setsockopt(server->fd, SOL_TCP, TCP_NODELAY, &opt, sizeof(opt));
+        setsockopt(remote->fd, SOL_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    }
+    remote->recv_ctx->connected = 1;
+}
+
 static void
 remote_recv_cb(EV_P_ ev_io *w, int revents)
 {
@@ -870,7 +1000,26 @@ remote_recv_cb(EV_P_ ev_io *w, int revents)
 
     ev_timer_again(EV_A_ & remote->recv_ctx->watcher);
 
-    ssize_t r = recv(remote->fd, server->buf->data, BUF_SIZE, 0);
+#ifdef USE_SPLICE
+    if (remote->splice) {
+        int ret = splice_relay(remote->fd, server->fd, remote->down, &remote->down_len);
+        if (ret != 1) {
+            if (ret == -1)
+                ERROR("remote_recv_cb_splice");
+            close_and_free_remote(EV_A_ remote);
+            close_and_free_server(EV_A_ server);
+            return;
+        } else if (remote->down_len > 0) {
+            // the client is slow, wait for send
+            ev_io_stop(EV_A_ & remote_recv_ctx->io);
+            ev_io_start(EV_A_ & server->send_ctx->io);
+        }
+        first_response_sent(server, remote);
+        return;
+    }
+#endif
+
+    ssize_t r = recv(remote->fd, server->buf->data, buf_size, 0);
 
     if (r == 0) {
         // connection closed
@@ -897,7 +1046,7 @@ remote_recv_cb(EV_P_ ev_io *w, int revents)
         rx += server->buf->len;
         stat_update_cb();
 #endif
-        int err = crypto->decrypt(server->buf, server->d_ctx, BUF_SIZE);
+        int err = crypto->decrypt(server->buf, server->d_ctx, buf_size);
         if (err == CRYPTO_ERROR) {
             LOGE("invalid password or cipher");
             close_and_free_remote(EV_A_ remote);
@@ -929,13 +1078,7 @@ remote_recv_cb(EV_P_ ev_io *w, int revents)
         ev_io_start(EV_A_ & server->send_ctx->io);
     }
 
-    // Disable TCP_NODELAY after the first response are sent
-    if (!remote->recv_ctx->connected && !no_delay) {
-        int opt = 0;
-        setsockopt(server->fd, SOL_TCP, TCP_NODELAY, &opt, sizeof(opt));
-        setsockopt(remote->fd, SOL_TCP, TCP_NODELAY, &opt, sizeof(opt));
-    }
-    remote->recv_ctx->connected = 1;
+    first_response_sent(server, remote);
 }
 
 static void
@@ -957,6 +1100,10 @@ remote_send_cb(EV_P_ ev_io *w, int revents)
 
             // no need to send any data
             if (remote->buf->len == 0) {
+#ifdef USE_SPLICE
+                if (remote->direct)
+                    splice_start(remote);
+#endif
                 ev_io_stop(EV_A_ & remote_send_ctx->io);
                 ev_io_start(EV_A_ & server->recv_ctx->io);
                 return;
@@ -970,6 +1117,20 @@ remote_send_cb(EV_P_ ev_io *w, int revents)
         }
     }
 
+#ifdef USE_SPLICE
+    if (remote->splice && remote->up_len > 0) {
+        if (splice_relay(-1, remote->fd, remote->up, &remote->up_len) == -1) {
+            ERROR("remote_send_cb_splice");
+            close_and_free_remote(EV_A_ remote);
+            close_and_free_server(EV_A_ server);
+        } else if (remote->up_len == 0) {
+            ev_io_stop(EV_A_ & remote_send_ctx->io);
+            ev_io_start(EV_A_ & server->recv_ctx->io);
+        }
+        return;
+    }
+#endif
+
     if (remote->buf->len == 0) {
         // close and free
         close_and_free_remote(EV_A_ remote);
@@ -996,6 +1157,10 @@ remote_send_cb(EV_P_ ev_io *w, int revents)
             // all sent out, wait for reading
             remote->buf->len = 0;
             remote->buf->idx = 0;
+#ifdef USE_SPLICE
+            if (remote->direct && !remote->splice)
+                splice_start(remote);
+#endif
             ev_io_stop(EV_A_ & remote_send_ctx->io);
             ev_io_start(EV_A_ & server->recv_ctx->io);
         }
@@ -1013,7 +1178,7 @@ new_remote(int fd, int timeout)
     remote->buf      = ss_malloc(sizeof(buffer_t));
     remote->recv_ctx = ss_malloc(sizeof(remote_ctx_t));
     remote->send_ctx = ss_malloc(sizeof(remote_ctx_t));
-    balloc(remote->buf, BUF_SIZE);
+    balloc(remote->buf, buf_size);
     memset(remote->recv_ctx, 0, sizeof(remote_ctx_t));
     memset(remote->send_ctx, 0, sizeof(remote_ctx_t));
     remote->recv_ctx->connected = 0;
@@ -1042,6 +1207,9 @@ free_remote(remote_t *remote)
         bfree(remote->buf);
         ss_free(remote->buf);
     }
+#ifdef USE_SPLICE
+    splice_stop(remote);
+#endif
     ss_free(remote->recv_ctx);
     ss_free(remote->send_ctx);
     ss_free(remote);
@@ -1072,8 +1240,8 @@ new_server(int fd)
     server->send_ctx = ss_malloc(sizeof(server_ctx_t));
     server->buf      = ss_malloc(sizeof(buffer_t));
     server->abuf     = ss_malloc(sizeof(buffer_t));
-    balloc(server->buf, BUF_SIZE);
-    balloc(server->abuf, BUF_SIZE);
+    balloc(server->buf, buf_size);
+    balloc(server->abuf, buf_size);
     memset(server->recv_ctx, 0, sizeof(server_ctx_t));
     memset(server->send_ctx, 0, sizeof(server_ctx_t));
     server->stage               = STAGE_INIT;
@@ -1251,6 +1419,7 @@ main(int argc, char **argv)
     int pid_flags    = 0;
     int mtu          = 0;
     int mptcp        = 0;
+    int udp_offload  = 0;
     char *user       = NULL;
     char *local_port = NULL;
     char *local_addr = NULL;
@@ -1268,14 +1437,17 @@ main(int argc, char **argv)
     char *remote_port = NULL;
 
     static struct option long_options[] = {
-        { "fast-open", no_argument,       NULL, GETOPT_VAL_FAST_OPEN },
-        { "no-delay",  no_argument,       NULL, GETOPT_VAL_NODELAY   },
-        { "acl",       required_argument, NULL, GETOPT_VAL_ACL       },
-        { "mtu",       required_argument, NULL, GETOPT_VAL_MTU       },
-        { "mptcp",     no_argument,       NULL, GETOPT_VAL_MPTCP     },
-        { "password",  required_argument, NULL, GETOPT_VAL_PASSWORD  },
-        { "help",      no_argument,       NULL, GETOPT_VAL_HELP      },
-        { NULL,                        0, NULL,                    0 }
+        { "fast-open",     no_argument,       NULL, GETOPT_VAL_FAST_OPEN     },
+        { "no-delay",      no_argument,       NULL, GETOPT_VAL_NODELAY       },
+        { "acl",           required_argument, NULL, GETOPT_VAL_ACL           },
+        { "mtu",           required_argument, NULL, GETOPT_VAL_MTU           },
+        { "mptcp",         no_argument,       NULL, GETOPT_VAL_MPTCP         },
+        { "password",      required_argument, NULL, GETOPT_VAL_PASSWORD      },
+        { "buffer-size",   required_argument, NULL, GETOPT_VAL_BUFFER_SIZE   },
+        { "udp-offload",   no_argument,       NULL, GETOPT_VAL_UDP_OFFLOAD   },
+        { "bench-ciphers", no_argument,       NULL, GETOPT_VAL_BENCH_CIPHERS },
+        { "help",          no_argument,       NULL, GETOPT_VAL_HELP          },
+        { NULL,                             0, NULL,                         0 }
     };
 
     opterr = 0;
@@ -1297,6 +1469,9 @@ main(int argc, char **argv)
             LOGI("initializing acl...");
             acl = !init_acl(optarg);
             break;
+        case GETOPT_VAL_BUFFER_SIZE:
+            buf_size = atoi(optarg);
+            break;
         case GETOPT_VAL_MTU:
             mtu = atoi(optarg);
             LOGI("set MTU to %d", mtu);
@@ -1305,6 +1480,12 @@ main(int argc, char **argv)
             mptcp = 1;
             LOGI("enable multipath TCP");
             break;
+        case GETOPT_VAL_BENCH_CIPHERS:
+            crypto_bench_ciphers(CRYPTO_BENCH_TIME);
+            exit(EXIT_SUCCESS);
+        case GETOPT_VAL_UDP_OFFLOAD:
+            udp_offload = 1;
+            break;
         case GETOPT_VAL_NODELAY:
             no_delay = 1;
             LOGI("enable TCP no-delay");
@@ -1428,9 +1609,15 @@ main(int argc, char **argv)
         if (mtu == 0) {
             mtu = conf->mtu;
         }
+        if (buf_size == BUF_SIZE && conf->buffer_size > 0) {
+            buf_size = conf->buffer_size;
+        }
         if (mptcp == 0) {
             mptcp = conf->mptcp;
         }
+        if (udp_offload == 0) {
+            udp_offload = conf->udp_offload;
+        }
 #ifdef HAVE_SETRLIMIT
         if (nofile == 0) {
             nofile = conf->nofile;
@@ -1458,6 +1645,11 @@ main(int argc, char **argv)
         timeout = "60";
     }
 
+    if (buf_size < MIN_BUF_SIZE || buf_size > MAX_BUF_SIZE) {
+        buf_size = max(MIN_BUF_SIZE, min(buf_size, MAX_BUF_SIZE));
+        LOGE("buffer size out of range, using %d", buf_size);
+    }
+
 #ifdef HAVE_SETRLIMIT
     /*
      * no need to check the return value here since we will show
@@ -1573,7 +1765,7 @@ main(int argc, char **argv)
         }
         struct sockaddr *addr = (struct sockaddr *)storage;
         udp_fd = init_udprelay(local_addr, local_port, addr,
-                               get_sockaddr_len(addr), mtu, crypto, listen_ctx.timeout, iface);
+                               get_sockaddr_len(addr), mtu, udp_offload, crypto, listen_ctx.timeout, iface);
     }
 
 #ifdef HAVE_LAUNCHD
@@ -1725,7 +1917,7 @@ start_ss_local_server(profile_t profile)
         LOGI("udprelay enabled");
         struct sockaddr *addr = (struct sockaddr *)(&storage);
         udp_fd = init_udprelay(local_addr, local_port_str, addr,
-                               get_sockaddr_len(addr), mtu, crypto, timeout, NULL);
+                               get_sockaddr_len(addr), mtu, 0, crypto, timeout, NULL);
     }
 
     // Init connections
@@ -32,6 +32,10 @@
 
 #include "common.h"
 
+#ifdef __linux__
+#define USE_SPLICE
+#endif
+
 typedef struct listen_ctx {
     ev_io io;
     char *iface;
@@ -87,6 +91,15 @@ typedef struct remote {
     struct remote_ctx *send_ctx;
     struct server *server;
     struct sockaddr_storage addr;
+
+#ifdef USE_SPLICE
+    // direct connections relay through these pipes with splice()
+    int splice;
+    int up[2];       // client to remote
+    int down[2];     // remote to client
+    size_t up_len;   // bytes waiting in up
+    size_t down_len; // bytes waiting in down
+#endif
 } remote_t;
 
 #endif // _LOCAL_H
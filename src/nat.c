@@ -0,0 +1,269 @@
+/*
+ * nat.c - Manage the UDP NAT table
+ *
+ * Copyright (C) 2013 - 2017, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#include <sodium.h>
+
+#include "nat.h"
+#include "utils.h"
+
+/** Builds the key of a source address
+ *
+ *  @param key
+ *  The key to fill
+ *
+ *  @param af
+ *  Family of the remote socket, or AF_UNSPEC
+ *
+ *  @param addr
+ *  The source address
+ */
+void
+nat_key_init(nat_key_t *key, int af, const struct sockaddr_storage *addr)
+{
+    memset(key, 0, sizeof(nat_key_t));
+    key->af     = af;
+    key->family = addr->ss_family;
+
+    if (addr->ss_family == AF_INET) {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+        key->port = in->sin_port;
+        memcpy(key->addr, &in->sin_addr, sizeof(struct in_addr));
+    } else if (addr->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+        key->port = in6->sin6_port;
+        memcpy(key->addr, &in6->sin6_addr, sizeof(struct in6_addr));
+    }
+}
+
+/*
+ * Source addresses come from the network, so the keys are hashed with
+ * SipHash and a random key, which keeps the probe chains short whatever
+ * addresses a peer picks.
+ */
+static inline uint32_t
+nat_hash(const nat_table_t *table, const nat_key_t *key)
+{
+    uint64_t h;
+    crypto_shorthash((unsigned char *)&h, (const unsigned char *)key,
+                     NAT_KEY_LEN(key), table->seed);
+    return (uint32_t)h;
+}
+
+static inline int
+nat_key_equal(const nat_key_t *a, const nat_key_t *b)
+{
+    return a->family == b->family && memcmp(a, b, NAT_KEY_LEN(a)) == 0;
+}
+
+/*
+ * Returns the slot holding the key, or the empty slot ending its chain.
+ */
+static nat_slot_t *
+nat_find(nat_table_t *table, const nat_key_t *key, uint32_t hash)
+{
+    size_t i = hash & table->mask;
+
+    while (table->slots[i].data != NULL) {
+        nat_slot_t *slot = &table->slots[i];
+        if (slot->hash == hash && nat_key_equal(&slot->key, key)) {
+            return slot;
+        }
+        i = (i + 1) & table->mask;
+    }
+
+    return &table->slots[i];
+}
+
+/** Creates a new NAT table
+ *
+ *  @param dst
+ *  Where the newly allocated table will be stored in
+ *
+ *  @param capacity
+ *  The maximum number of entries this table can hold
+ *
+ *  @return EINVAL if dst is NULL, ENOMEM if malloc fails, 0 otherwise
+ */
+int
+nat_create(nat_table_t **dst, const size_t capacity)
+{
+    nat_table_t *new = NULL;
+    size_t size      = 16;
+
+    if (!dst) {
+        return EINVAL;
+    }
+
+    // Keep the load factor at or below 1/2
+    while (size < capacity * 2) {
+        size <<= 1;
+    }
+
+    if ((new = malloc(sizeof(*new))) == NULL) {
+        return ENOMEM;
+    }
+
+    if ((new->slots = calloc(size, sizeof(nat_slot_t))) == NULL) {
+        free(new);
+        return ENOMEM;
+    }
+
+    new->max_entries = capacity;
+    new->count       = 0;
+    new->mask        = size - 1;
+    randombytes_buf(new->seed, sizeof(new->seed));
+    *dst = new;
+    return 0;
+}
+
+/** Frees a NAT table, the data of its entries is left alone
+ *
+ *  @param table
+ *  The table to free
+ *
+ *  @return EINVAL if table is NULL, 0 otherwise
+ */
+int
+nat_delete(nat_table_t *table)
+{
+    if (!table) {
+        return EINVAL;
+    }
+
+    ss_free(table->slots);
+    ss_free(table);
+    return 0;
+}
+
+/** Looks up a key
+ *
+ *  @param table
+ *  The NAT table
+ *
+ *  @param key
+ *  The key to look up
+ *
+ *  @return The data of the key, or NULL if not found
+ */
+void *
+nat_lookup(nat_table_t *table, const nat_key_t *key)
+{
+    if (!table || !key) {
+        return NULL;
+    }
+
+    return nat_find(table, key, nat_hash(table, key))->data;
+}
+
+/** Inserts a given <key, value> pair, replacing the value of a known key
+ *
+ *  @param table
+ *  The NAT table
+ *
+ *  @param key
+ *  The key that identifies <value>
+ *
+ *  @param data
+ *  Data associated with <key>, not NULL
+ *
+ *  @return EINVAL if table or data is NULL, ENOMEM if the table is full,
+ *  0 otherwise
+ */
+int
+nat_insert(nat_table_t *table, const nat_key_t *key, void *data)
+{
+    if (!table || !key || !data) {
+        return EINVAL;
+    }
+
+    uint32_t hash    = nat_hash(table, key);
+    nat_slot_t *slot = nat_find(table, key, hash);
+
+    if (slot->data == NULL) {
+        if (table->count >= table->max_entries) {
+            return ENOMEM;
+        }
+        slot->key  = *key;
+        slot->hash = hash;
+        table->count++;
+    }
+    slot->data = data;
+
+    return 0;
+}
+
+/** Removes a key
+ *
+ *  @param table
+ *  The NAT table
+ *
+ *  @param key
+ *  The key of the entry to remove
+ *
+ *  @return EINVAL if table is NULL, 0 otherwise
+ */
+int
+nat_remove(nat_table_t *table, const nat_key_t *key)
+{
+    if (!table || !key) {
+        return EINVAL;
+    }
+
+    nat_slot_t *slot = nat_find(table, key, nat_hash(table, key));
+    if (slot->data == NULL) {
+        return 0;
+    }
+
+    /*
+     * Shift the rest of the chain back over the hole, so lookups never
+     * have to skip tombstones. An entry moves only if the hole lies
+     * between its home slot and where it is now.
+     */
+    size_t i = slot - table->slots;
+    size_t j = i;
+
+    for (;;) {
+        j = (j + 1) & table->mask;
+        if (table->slots[j].data == NULL) {
+            break;
+        }
+        size_t home = table->slots[j].hash & table->mask;
+        if (((j - home) & table->mask) >= ((j - i) & table->mask)) {
+            table->slots[i] = table->slots[j];
+            i = j;
+        }
+    }
+
+    memset(&table->slots[i], 0, sizeof(nat_slot_t));
+    table->count--;
+
+    return 0;
+}
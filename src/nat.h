@@ -0,0 +1,75 @@
+/*
+ * nat.h - Define the UDP NAT table interface
+ *
+ * Copyright (C) 2013 - 2017, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _NAT_H
+#define _NAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/**
+ * A NAT key, an address and the socket it goes with: the source address of
+ * a UDP association and the family of the socket it is relayed from, or the
+ * address of a peer and the index of the shared socket it talks to. Only
+ * the first 8 bytes of an IPv4 key and the 20 bytes of an IPv6 key are used.
+ */
+typedef struct nat_key {
+    uint8_t af;        /**<Family or index of the socket, or AF_UNSPEC */
+    uint8_t family;    /**<Family of the source address */
+    uint16_t port;     /**<Source port, in network order */
+    uint8_t addr[16];  /**<Source address */
+} nat_key_t;
+
+#define NAT_KEY_LEN(key) \
+    (offsetof(nat_key_t, addr) + ((key)->family == AF_INET6 ? 16 : 4))
+
+/**
+ * A slot of the table, empty when data is NULL
+ */
+typedef struct nat_slot {
+    nat_key_t key;     /**<The key, stored inline */
+    uint32_t hash;     /**<Hash of the key */
+    void *data;        /**<Payload */
+} nat_slot_t;
+
+/**
+ * An open addressing table with linear probing, sized so that it is
+ * never more than half full.
+ */
+typedef struct nat_table {
+    size_t max_entries;                /**<Amount of entries this table can hold */
+    size_t count;                      /**<Amount of entries in the table */
+    size_t mask;                       /**<Number of slots minus one */
+    nat_slot_t *slots;                 /**<The slots */
+    unsigned char seed[16];            /**<Random key of the hash function */
+} nat_table_t;
+
+void nat_key_init(nat_key_t *key, int af, const struct sockaddr_storage *addr);
+
+int nat_create(nat_table_t **dst, const size_t capacity);
+int nat_delete(nat_table_t *table);
+void *nat_lookup(nat_table_t *table, const nat_key_t *key);
+int nat_insert(nat_table_t *table, const nat_key_t *key, void *data);
+int nat_remove(nat_table_t *table, const nat_key_t *key);
+
+#endif
@@ -95,6 +95,7 @@ static int nofile = 0;
 #endif
 static int fast_open = 0;
 static int no_delay  = 0;
+static int buf_size  = BUF_SIZE;
 
 static struct ev_signal sigint_watcher;
 static struct ev_signal sigterm_watcher;
@@ -192,7 +193,7 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
     ev_timer_stop(EV_A_ & server->delayed_connect_watcher);
 
     ssize_t r = recv(server->fd, remote->buf->data + remote->buf->len,
-                     BUF_SIZE - remote->buf->len, 0);
+                     buf_size - remote->buf->len, 0);
 
     if (r == 0) {
         // connection closed
@@ -238,7 +239,7 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
         return;
     }
 
-    int err = crypto->encrypt(remote->buf, server->e_ctx, BUF_SIZE);
+    int err = crypto->encrypt(remote->buf, server->e_ctx, buf_size);
 
     if (err) {
         LOGE("invalid password or cipher");
@@ -359,7 +360,7 @@ remote_recv_cb(EV_P_ ev_io *w, int revents)
 
     ev_timer_again(EV_A_ & remote->recv_ctx->watcher);
 
-    ssize_t r = recv(remote->fd, server->buf->data, BUF_SIZE, 0);
+    ssize_t r = recv(remote->fd, server->buf->data, buf_size, 0);
 
     if (r == 0) {
         // connection closed
@@ -381,7 +382,7 @@ remote_recv_cb(EV_P_ ev_io *w, int revents)
 
     server->buf->len = r;
 
-    int err = crypto->decrypt(server->buf, server->d_ctx, BUF_SIZE);
+    int err = crypto->decrypt(server->buf, server->d_ctx, buf_size);
     if (err == CRYPTO_ERROR) {
         LOGE("invalid password or cipher");
         close_and_free_remote(EV_A_ remote);
@@ -449,7 +450,7 @@ remote_send_cb(EV_P_ ev_io *w, int revents)
             // send destaddr
             buffer_t ss_addr_to_send;
             buffer_t *abuf = &ss_addr_to_send;
-            balloc(abuf, BUF_SIZE);
+            balloc(abuf, buf_size);
 
             if (AF_INET6 == server->destaddr.ss_family) { // IPv6
                 abuf->data[abuf->len++] = 4;          // Type 4 is IPv6 address
@@ -475,7 +476,7 @@ remote_send_cb(EV_P_ ev_io *w, int revents)
 
             abuf->len += 2;
 
-            int err = crypto->encrypt(abuf, server->e_ctx, BUF_SIZE);
+            int err = crypto->encrypt(abuf, server->e_ctx, buf_size);
             if (err) {
                 LOGE("invalid password or cipher");
                 bfree(abuf);
@@ -484,7 +485,7 @@ remote_send_cb(EV_P_ ev_io *w, int revents)
                 return;
             }
 
-            err = crypto->encrypt(remote->buf, server->e_ctx, BUF_SIZE);
+            err = crypto->encrypt(remote->buf, server->e_ctx, buf_size);
             if (err) {
                 LOGE("invalid password or cipher");
                 bfree(abuf);
@@ -493,7 +494,7 @@ remote_send_cb(EV_P_ ev_io *w, int revents)
                 return;
             }
 
-            bprepend(remote->buf, abuf, BUF_SIZE);
+            bprepend(remote->buf, abuf, buf_size);
             bfree(abuf);
         } else {
             ERROR("getpeername");
@@ -586,7 +587,7 @@ new_remote(int fd, int timeout)
     remote->recv_ctx = ss_malloc(sizeof(remote_ctx_t));
     remote->send_ctx = ss_malloc(sizeof(remote_ctx_t));
     remote->buf      = ss_malloc(sizeof(buffer_t));
-    balloc(remote->buf, BUF_SIZE);
+    balloc(remote->buf, buf_size);
     memset(remote->recv_ctx, 0, sizeof(remote_ctx_t));
     memset(remote->send_ctx, 0, sizeof(remote_ctx_t));
     remote->fd                  = fd;
@@ -642,7 +643,7 @@ new_server(int fd)
     server->recv_ctx = ss_malloc(sizeof(server_ctx_t));
     server->send_ctx = ss_malloc(sizeof(server_ctx_t));
     server->buf      = ss_malloc(sizeof(buffer_t));
-    balloc(server->buf, BUF_SIZE);
+    balloc(server->buf, buf_size);
     memset(server->recv_ctx, 0, sizeof(server_ctx_t));
     memset(server->send_ctx, 0, sizeof(server_ctx_t));
     server->fd                  = fd;
@@ -844,13 +845,14 @@ main(int argc, char **argv)
     char *remote_port = NULL;
 
     static struct option long_options[] = {
-        { "fast-open", no_argument,       NULL, GETOPT_VAL_FAST_OPEN },
-        { "mtu",       required_argument, NULL, GETOPT_VAL_MTU       },
-        { "mptcp",     no_argument,       NULL, GETOPT_VAL_MPTCP     },
-        { "no-delay",  no_argument,       NULL, GETOPT_VAL_NODELAY   },
-        { "password",  required_argument, NULL, GETOPT_VAL_PASSWORD  },
-        { "help",      no_argument,       NULL, GETOPT_VAL_HELP      },
-        { NULL,                        0, NULL,                    0 }
+        { "fast-open",   no_argument,       NULL, GETOPT_VAL_FAST_OPEN   },
+        { "mtu",         required_argument, NULL, GETOPT_VAL_MTU         },
+        { "mptcp",       no_argument,       NULL, GETOPT_VAL_MPTCP       },
+        { "no-delay",    no_argument,       NULL, GETOPT_VAL_NODELAY     },
+        { "password",    required_argument, NULL, GETOPT_VAL_PASSWORD    },
+        { "buffer-size", required_argument, NULL, GETOPT_VAL_BUFFER_SIZE },
+        { "help",        no_argument,       NULL, GETOPT_VAL_HELP        },
+        { NULL,                          0, NULL,                      0 }
     };
 
     opterr = 0;
@@ -863,6 +865,9 @@ main(int argc, char **argv)
         case GETOPT_VAL_FAST_OPEN:
             fast_open = 1;
             break;
+        case GETOPT_VAL_BUFFER_SIZE:
+            buf_size = atoi(optarg);
+            break;
         case GETOPT_VAL_MTU:
             mtu = atoi(optarg);
             LOGI("set MTU to %d", mtu);
@@ -984,6 +989,9 @@ main(int argc, char **argv)
         if (mtu == 0) {
             mtu = conf->mtu;
         }
+        if (buf_size == BUF_SIZE && conf->buffer_size > 0) {
+            buf_size = conf->buffer_size;
+        }
         if (mptcp == 0) {
             mptcp = conf->mptcp;
         }
@@ -1014,6 +1022,11 @@ main(int argc, char **argv)
         timeout = "600";
     }
 
+    if (buf_size < MIN_BUF_SIZE || buf_size > MAX_BUF_SIZE) {
+        buf_size = max(MIN_BUF_SIZE, min(buf_size, MAX_BUF_SIZE));
+        LOGE("buffer size out of range, using %d", buf_size);
+    }
+
 #ifdef HAVE_SETRLIMIT
     /*
      * no need to check the return value here since we will show
@@ -1120,7 +1133,7 @@ main(int argc, char **argv)
         }
         struct sockaddr *addr = (struct sockaddr *)storage;
         init_udprelay(local_addr, local_port, addr,
-                      get_sockaddr_len(addr), mtu, crypto, listen_ctx.timeout, NULL);
+                      get_sockaddr_len(addr), mtu, 0, crypto, listen_ctx.timeout, NULL);
     }
 
     if (mode == UDP_ONLY) {
@@ -36,7 +36,10 @@
 #include <netdb.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
 #include <errno.h>
+#include <limits.h>
 #include <unistd.h>
 
 #include <ares.h>
@@ -46,11 +49,25 @@
 #include <libcork/core.h>
 
 #include "resolv.h"
+#include "cache.h"
+#include "uthash.h"
 #include "utils.h"
 #include "netutils.h"
 
 #define MAX_RESOLVE_CTX_NUM 2048
 
+/* Names whose answers are kept */
+#define MAX_RESOLV_CACHE_NUM 4096
+/* Addresses read from an answer */
+#define MAX_RESOLV_ADDR_NUM 16
+
+/* Bounds of the TTL of a cached answer, in seconds */
+#define RESOLV_MAX_TTL 3600
+/* Names that do not exist, or have no address of the wanted family */
+#define RESOLV_NEGATIVE_TTL 30
+/* Names found in the hosts file */
+#define RESOLV_FILE_TTL 60
+
 /*
  * Implement DNS resolution interface using libc-ares
  */
@@ -61,6 +78,20 @@ struct resolv_ctx {
     int is_used;
 };
 
+/*
+ * A client that asked for a name already being resolved
+ */
+struct resolv_waiter {
+    void (*client_cb)(struct sockaddr *, void *);
+    void (*free_cb)(void *);
+
+    uint16_t port;
+
+    void *data;
+
+    struct resolv_waiter *next;
+};
+
 struct resolv_query {
     int requests[2];
     size_t response_count;
@@ -71,7 +102,24 @@ struct resolv_query {
 
     uint16_t port;
 
+    char *hostname;
+    int ttl;        /* lowest TTL of the addresses */
+    int transient;  /* a request failed for a reason that may go away */
+
     void *data;
+
+    struct resolv_waiter *waiters;  /* other clients of the same name */
+    UT_hash_handle hh;              /* in the in-flight queries */
+};
+
+/*
+ * The answer to a name, cached until it expires. The resolve mode is
+ * set once for the process, so the name alone is the key.
+ */
+struct resolv_entry {
+    ev_tstamp expires;
+    int found;      /* 0 for a negative answer */
+    struct sockaddr_storage addr;
 };
 
 extern int verbose;
@@ -96,17 +144,29 @@ static struct ev_loop *default_loop;
 
 static int resolv_mode = RESOLV_MODE_IPV4_ONLY;
 
+/* answers by name */
+static struct cache *resolv_cache;
+
+/* queries sent to c-ares by name, a name is only resolved once at a time */
+static struct resolv_query *inflight_queries;
+
 static void ares_io_handler(struct ev_loop *, struct ev_io *, int);
 static void ares_fd_process_cb(struct ev_loop *, struct ev_timer *, int);
 static void ares_resolv_sock_state_cb(void *, ares_socket_t, int, int);
 static int ares_resolv_sock_config_cb(ares_socket_t, int, void *);
 static int ares_resolv_sock_cb(ares_socket_t, int, void *);
 
-static void dns_query_v4_cb(void *, int, int, struct hostent *);
-static void dns_query_v6_cb(void *, int, int, struct hostent *);
+static void dns_query_v4_cb(void *, int, int, unsigned char *, int);
+static void dns_query_v6_cb(void *, int, int, unsigned char *, int);
 
+static void add_response(struct resolv_query *, int, const void *);
+static int resolv_literal(struct resolv_query *, const char *);
+static int resolv_file(struct resolv_query *, const char *);
+static void cache_answer(struct resolv_query *, struct sockaddr *);
+static void answer_query(struct resolv_query *);
 static void process_client_callback(struct resolv_query *);
 static inline int all_requests_are_null(struct resolv_query *);
+static struct sockaddr *choose_best(struct resolv_query *);
 static struct sockaddr *choose_ipv4_first(struct resolv_query *);
 static struct sockaddr *choose_ipv6_first(struct resolv_query *);
 static struct sockaddr *choose_any(struct resolv_query *);
@@ -177,6 +237,10 @@ resolv_init(struct ev_loop *loop, char *nameservers, int mode)
 
     init_resolv_ctxs();
 
+    if (cache_create(&resolv_cache, MAX_RESOLV_CACHE_NUM, NULL) != 0) {
+        FATAL("failed to create the DNS cache");
+    }
+
     return 0;
 }
 
@@ -191,8 +255,16 @@ resolv_shutdown(struct ev_loop *loop)
     }
     cleanup_resolv_ctxs();
     ares_library_cleanup();
+    cache_delete(resolv_cache, 0);
+    resolv_cache = NULL;
 }
 
+/*
+ * IP literals, fresh cache entries and names from the hosts file are
+ * answered before resolv_start() returns: client_cb and free_cb run
+ * synchronously then. Callers rely on that, server.c sets STAGE_RESOLVE
+ * before the call and the resolv_cb of udprelay.c calls sendto() directly.
+ */
 void
 resolv_start(const char *hostname, uint16_t port,
              void (*client_cb)(struct sockaddr *, void *),
@@ -208,72 +280,209 @@ resolv_start(const char *hostname, uint16_t port,
     query->responses      = NULL;
     query->data           = data;
     query->free_cb        = free_cb;
+    query->hostname       = ss_strndup(hostname, strlen(hostname));
+    query->ttl            = INT_MAX;
+
+    /* IP literals need no query */
+    if (resolv_literal(query, hostname)) {
+        answer_query(query);
+        return;
+    }
+
+    /* Answer from the cache while it is fresh */
+    struct resolv_entry *entry = NULL;
+    size_t key_len             = strlen(hostname);
+    cache_lookup(resolv_cache, query->hostname, key_len, &entry);
+    if (entry != NULL) {
+        if (entry->expires > ev_now(default_loop)) {
+            if (entry->found) {
+                add_response(query, entry->addr.ss_family,
+                             entry->addr.ss_family == AF_INET
+                             ? (void *)&((struct sockaddr_in *)&entry->addr)->sin_addr
+                             : (void *)&((struct sockaddr_in6 *)&entry->addr)->sin6_addr);
+            }
+            if (verbose) {
+                LOGI("found address of %s in cache", hostname);
+            }
+            answer_query(query);
+            return;
+        }
+        cache_remove(resolv_cache, query->hostname, key_len);
+    }
+
+    /* Nor do names from the hosts file */
+    if (resolv_file(query, hostname)) {
+        query->ttl = RESOLV_FILE_TTL;
+        cache_answer(query, choose_best(query));
+        answer_query(query);
+        return;
+    }
+
+    /* Wait for the answer of the same name if it is on its way */
+    struct resolv_query *inflight = NULL;
+    HASH_FIND(hh, inflight_queries, query->hostname, key_len, inflight);
+    if (inflight != NULL) {
+        struct resolv_waiter *waiter = ss_malloc(sizeof(struct resolv_waiter));
+        waiter->client_cb = client_cb;
+        waiter->free_cb   = free_cb;
+        waiter->port      = port;
+        waiter->data      = data;
+        waiter->next      = inflight->waiters;
+        inflight->waiters = waiter;
+
+        if (verbose) {
+            LOGI("wait for the lookup of %s in flight", hostname);
+        }
+
+        ss_free(query->hostname);
+        ss_free(query);
+        return;
+    }
+    HASH_ADD_KEYPTR(hh, inflight_queries, query->hostname, key_len, query);
 
     /* Submit A and AAAA requests */
     if (resolv_mode != RESOLV_MODE_IPV6_ONLY) {
-        ares_gethostbyname(default_channel, hostname, AF_INET, dns_query_v4_cb, query);
         query->requests[0] = AF_INET;
+        ares_search(default_channel, hostname, ns_c_in, ns_t_a, dns_query_v4_cb, query);
     }
 
     if (resolv_mode != RESOLV_MODE_IPV4_ONLY) {
-        ares_gethostbyname(default_channel, hostname, AF_INET6, dns_query_v6_cb, query);
         query->requests[1] = AF_INET6;
+        ares_search(default_channel, hostname, ns_c_in, ns_t_aaaa, dns_query_v6_cb, query);
     }
 }
 
 /*
- * Wrapper for client callback we provide to c-ares
+ * Adds an address of the given family to the responses of a query
  */
 static void
-dns_query_v4_cb(void *arg, int status, int timeouts, struct hostent *he)
+add_response(struct resolv_query *query, int family, const void *addr)
 {
+    struct sockaddr **new_responses = ss_realloc(query->responses,
+                                                 (query->response_count + 1)
+                                                 * sizeof(struct sockaddr *));
+
+    if (new_responses == NULL) {
+        LOGE("failed to allocate memory for additional DNS responses");
+        return;
+    }
+    query->responses = new_responses;
+
+    if (family == AF_INET) {
+        struct sockaddr_in *sa = ss_malloc(sizeof(struct sockaddr_in));
+        memset(sa, 0, sizeof(struct sockaddr_in));
+        sa->sin_family = AF_INET;
+        sa->sin_port   = query->port;
+        memcpy(&sa->sin_addr, addr, sizeof(struct in_addr));
+        query->responses[query->response_count++] = (struct sockaddr *)sa;
+    } else {
+        struct sockaddr_in6 *sa = ss_malloc(sizeof(struct sockaddr_in6));
+        memset(sa, 0, sizeof(struct sockaddr_in6));
+        sa->sin6_family = AF_INET6;
+        sa->sin6_port   = query->port;
+        memcpy(&sa->sin6_addr, addr, sizeof(struct in6_addr));
+        query->responses[query->response_count++] = (struct sockaddr *)sa;
+    }
+}
+
+/*
+ * Answers a query for an IP literal of a family of the resolve mode.
+ * Returns the number of responses.
+ */
+static int
+resolv_literal(struct resolv_query *query, const char *hostname)
+{
+    struct in6_addr addr;
+
+    if (resolv_mode != RESOLV_MODE_IPV6_ONLY
+        && inet_pton(AF_INET, hostname, &addr) == 1) {
+        add_response(query, AF_INET, &addr);
+    } else if (resolv_mode != RESOLV_MODE_IPV4_ONLY
+               && inet_pton(AF_INET6, hostname, &addr) == 1) {
+        add_response(query, AF_INET6, &addr);
+    }
+
+    return query->response_count;
+}
+
+/*
+ * Answers a query with the addresses of a name in the hosts file, for the
+ * families of the resolve mode. Returns the number of responses.
+ */
+static int
+resolv_file(struct resolv_query *query, const char *hostname)
+{
+    int families[2] = { AF_INET, AF_INET6 };
     int i, n;
+
+    for (i = 0; i < 2; i++) {
+        struct hostent *he = NULL;
+        if ((families[i] == AF_INET && resolv_mode == RESOLV_MODE_IPV6_ONLY)
+            || (families[i] == AF_INET6 && resolv_mode == RESOLV_MODE_IPV4_ONLY)) {
+            continue;
+        }
+        if (ares_gethostbyname_file(default_channel, hostname, families[i],
+                                    &he) != ARES_SUCCESS) {
+            continue;
+        }
+        for (n = 0; he->h_addr_list[n] != NULL; n++)
+            add_response(query, families[i], he->h_addr_list[n]);
+        ares_free_hostent(he);
+    }
+
+    return query->response_count;
+}
+
+/*
+ * Notes the outcome of a request: the lowest TTL of its addresses, and
+ * whether a failure may not last, which keeps a negative answer out of
+ * the cache.
+ */
+static void
+update_query(struct resolv_query *query, int status, int ttl)
+{
+    if (status == ARES_SUCCESS) {
+        if (ttl < query->ttl) {
+            query->ttl = ttl;
+        }
+    } else if (status != ARES_ENOTFOUND && status != ARES_ENODATA) {
+        query->transient = 1;
+    }
+}
+
+/*
+ * Wrapper for client callback we provide to c-ares
+ */
+static void
+dns_query_v4_cb(void *arg, int status, int timeouts, unsigned char *abuf, int alen)
+{
+    int i, n = MAX_RESOLV_ADDR_NUM;
+    struct ares_addrttl addrttls[MAX_RESOLV_ADDR_NUM];
     struct resolv_query *query = (struct resolv_query *)arg;
 
     if (status == ARES_EDESTRUCTION) {
         return;
     }
 
-    if (!he || status != ARES_SUCCESS) {
+    if (status == ARES_SUCCESS) {
+        status = ares_parse_a_reply(abuf, alen, NULL, addrttls, &n);
+    }
+
+    if (status != ARES_SUCCESS) {
         if (verbose) {
             LOGI("failed to lookup v4 address %s", ares_strerror(status));
         }
+        update_query(query, status, 0);
         goto CLEANUP;
     }
 
     if (verbose) {
-        LOGI("found address name v4 address %s", he->h_name);
-    }
-
-    n = 0;
-    while (he->h_addr_list[n])
-        n++;
-
-    if (n > 0) {
-        struct sockaddr **new_responses = ss_realloc(query->responses,
-                                                     (query->response_count + n)
-                                                     * sizeof(struct sockaddr *));
-
-        if (new_responses == NULL) {
-            LOGE("failed to allocate memory for additional DNS responses");
-        } else {
-            query->responses = new_responses;
-
-            for (i = 0; i < n; i++) {
-                struct sockaddr_in *sa = ss_malloc(sizeof(struct sockaddr_in));
-                memset(sa, 0, sizeof(struct sockaddr_in));
-                sa->sin_family = AF_INET;
-                sa->sin_port   = query->port;
-                memcpy(&sa->sin_addr, he->h_addr_list[i], he->h_length);
-
-                query->responses[query->response_count] = (struct sockaddr *)sa;
-                if (query->responses[query->response_count] == NULL) {
-                    LOGE("failed to allocate memory for DNS query result address");
-                } else {
-                    query->response_count++;
-                }
-            }
-        }
+        LOGI("found address name v4 address %s", query->hostname);
+    }
+
+    for (i = 0; i < n; i++) {
+        add_response(query, AF_INET, &addrttls[i].ipaddr);
+        update_query(query, status, addrttls[i].ttl);
     }
 
 CLEANUP:
@@ -287,60 +496,40 @@ CLEANUP:
 }
 
 static void
-dns_query_v6_cb(void *arg, int status, int timeouts, struct hostent *he)
+dns_query_v6_cb(void *arg, int status, int timeouts, unsigned char *abuf, int alen)
 {
-    int i, n;
+    int i, n = MAX_RESOLV_ADDR_NUM;
+    struct ares_addr6ttl addrttls[MAX_RESOLV_ADDR_NUM];
     struct resolv_query *query = (struct resolv_query *)arg;
 
     if (status == ARES_EDESTRUCTION) {
         return;
     }
 
-    if (!he || status != ARES_SUCCESS) {
+    if (status == ARES_SUCCESS) {
+        status = ares_parse_aaaa_reply(abuf, alen, NULL, addrttls, &n);
+    }
+
+    if (status != ARES_SUCCESS) {
         if (verbose) {
             LOGI("failed to lookup v6 address %s", ares_strerror(status));
         }
+        update_query(query, status, 0);
         goto CLEANUP;
     }
 
     if (verbose) {
-        LOGI("found address name v6 address %s", he->h_name);
-    }
-
-    n = 0;
-    while (he->h_addr_list[n])
-        n++;
-
-    if (n > 0) {
-        struct sockaddr **new_responses = ss_realloc(query->responses,
-                                                     (query->response_count + n)
-                                                     * sizeof(struct sockaddr *));
-
-        if (new_responses == NULL) {
-            LOGE("failed to allocate memory for additional DNS responses");
-        } else {
-            query->responses = new_responses;
-
-            for (i = 0; i < n; i++) {
-                struct sockaddr_in6 *sa = ss_malloc(sizeof(struct sockaddr_in6));
-                memset(sa, 0, sizeof(struct sockaddr_in6));
-                sa->sin6_family = AF_INET6;
-                sa->sin6_port   = query->port;
-                memcpy(&sa->sin6_addr, he->h_addr_list[i], he->h_length);
-
-                query->responses[query->response_count] = (struct sockaddr *)sa;
-                if (query->responses[query->response_count] == NULL) {
-                    LOGE("failed to allocate memory for DNS query result address");
-                } else {
-                    query->response_count++;
-                }
-            }
-        }
+        LOGI("found address name v6 address %s", query->hostname);
+    }
+
+    for (i = 0; i < n; i++) {
+        add_response(query, AF_INET6, &addrttls[i].ip6addr);
+        update_query(query, status, addrttls[i].ttl);
     }
 
 CLEANUP:
 
-    query->requests[1] = 0; /* mark A query as being completed */
+    query->requests[1] = 0; /* mark AAAA query as being completed */
 
     /* Once all requests have completed, call client callback */
     if (all_requests_are_null(query)) {
@@ -349,23 +538,76 @@ CLEANUP:
 }
 
 /*
- * Called once all requests have been completed
+ * Keeps the chosen address of a query, or the lack of one, for as long
+ * as its TTL allows
  */
 static void
-process_client_callback(struct resolv_query *query)
+cache_answer(struct resolv_query *query, struct sockaddr *best_address)
 {
-    struct sockaddr *best_address = NULL;
+    int ttl;
 
-    if (resolv_mode == RESOLV_MODE_IPV4_FIRST) {
-        best_address = choose_ipv4_first(query);
-    } else if (resolv_mode == RESOLV_MODE_IPV6_FIRST) {
-        best_address = choose_ipv6_first(query);
+    if (best_address != NULL) {
+        ttl = query->ttl < RESOLV_MAX_TTL ? query->ttl : RESOLV_MAX_TTL;
+    } else if (!query->transient) {
+        ttl = RESOLV_NEGATIVE_TTL;
     } else {
-        best_address = choose_any(query);
+        return;
+    }
+
+    if (ttl <= 0) {
+        return;
     }
 
+    struct resolv_entry *entry = ss_malloc(sizeof(struct resolv_entry));
+    memset(entry, 0, sizeof(struct resolv_entry));
+    entry->expires = ev_now(default_loop) + ttl;
+    if (best_address != NULL) {
+        entry->found = 1;
+        memcpy(&entry->addr, best_address, get_sockaddr_len(best_address));
+    }
+
+    size_t key_len = strlen(query->hostname);
+    cache_remove(resolv_cache, query->hostname, key_len);
+    cache_insert(resolv_cache, query->hostname, key_len, entry);
+}
+
+/*
+ * Hands the best address to the clients and frees the query
+ */
+static void
+answer_query(struct resolv_query *query)
+{
+    struct sockaddr *best_address = choose_best(query);
+
     query->client_cb(best_address, query->data);
 
+    /* The others get the same address, with the port they asked for */
+    while (query->waiters != NULL) {
+        struct resolv_waiter *waiter = query->waiters;
+        struct sockaddr_storage addr;
+
+        query->waiters = waiter->next;
+
+        if (best_address != NULL) {
+            memcpy(&addr, best_address, get_sockaddr_len(best_address));
+            if (addr.ss_family == AF_INET) {
+                ((struct sockaddr_in *)&addr)->sin_port = waiter->port;
+            } else {
+                ((struct sockaddr_in6 *)&addr)->sin6_port = waiter->port;
+            }
+        }
+
+        waiter->client_cb(best_address != NULL ? (struct sockaddr *)&addr : NULL,
+                          waiter->data);
+
+        if (waiter->free_cb != NULL)
+            waiter->free_cb(waiter->data);
+        else
+            ss_free(waiter->data);
+
+        ss_free(waiter);
+    }
+
     for (int i = 0; i < query->response_count; i++)
         ss_free(query->responses[i]);
 
@@ -376,12 +618,38 @@ process_client_callback(struct resolv_query *query)
     else
         ss_free(query->data);
 
+    ss_free(query->hostname);
     ss_free(query);
+}
+
+/*
+ * Called once all requests have been completed
+ */
+static void
+process_client_callback(struct resolv_query *query)
+{
+    /* Later lookups are answered from the cache, or start a new query */
+    HASH_DELETE(hh, inflight_queries, query);
+
+    cache_answer(query, choose_best(query));
+    answer_query(query);
 
     --current_ctx_num;
     adjust_fd_process_timer();
 }
 
+static struct sockaddr *
+choose_best(struct resolv_query *query)
+{
+    if (resolv_mode == RESOLV_MODE_IPV4_FIRST) {
+        return choose_ipv4_first(query);
+    } else if (resolv_mode == RESOLV_MODE_IPV6_FIRST) {
+        return choose_ipv6_first(query);
+    } else {
+        return choose_any(query);
+    }
+}
+
 static struct sockaddr *
 choose_ipv4_first(struct resolv_query *query)
 {
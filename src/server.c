@@ -42,6 +42,12 @@
 #include <netinet/in.h>
 #include <pthread.h>
 #include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
 
 #include <libcork/core.h>
 #include <ares.h>
@@ -101,6 +107,7 @@ static void resolv_free_cb(void *data);
 
 int verbose = 0;
 char *local_addr = NULL;
+int udp_pool     = 0;
 
 static crypto_t *crypto;
 
@@ -109,6 +116,9 @@ static int mode      = TCP_ONLY;
 static int ipv6first = 0;
 static int fast_open = 0;
 static int no_delay  = 0;
+static int buf_size  = BUF_SIZE;
+static int replay_window = FS_BF_REPLAY_WINDOW;
+static char *replay_file = NULL;
 
 #ifdef HAVE_SETRLIMIT
 static int nofile = 0;
@@ -122,6 +132,18 @@ uint64_t tx               = 0;
 uint64_t rx               = 0;
 ev_timer stat_update_watcher;
 ev_timer block_list_watcher;
+ev_timer sbf_expire_watcher;
+ev_timer sbf_flush_watcher;
+
+typedef struct worker_stat {
+    uint64_t tx;
+    uint64_t rx;
+} worker_stat_t;
+
+static int worker_num              = 1;
+static int worker_id               = 0;
+static pid_t *worker_pids          = NULL;
+static worker_stat_t *worker_stats = NULL;
 
 static struct ev_signal sigint_watcher;
 static struct ev_signal sigterm_watcher;
@@ -129,6 +151,19 @@ static struct ev_signal sigchld_watcher;
 
 static struct cork_dllist connections;
 
+/*
+ * Connection objects are recycled through per-process pools. Up to
+ * CONN_POOL_IDLE_BUFS pooled objects keep their buffer while they sit on
+ * the free list, so accepting a connection does not touch malloc once the
+ * pools are warm, and the buffers of a past peak are given back.
+ */
+#define CONN_POOL_BLOCK_SIZE (64 * 1024)
+#define CONN_POOL_IDLE_BUFS  128
+
+static struct cork_mempool *server_pool = NULL;
+static struct cork_mempool *remote_pool = NULL;
+static int idle_bufs                    = 0;
+
 static void
 stat_update_cb(EV_P_ ev_timer *watcher, int revents)
 {
@@ -136,12 +171,29 @@ stat_update_cb(EV_P_ ev_timer *watcher, int revents)
     int sfd = -1;
     size_t msgLen;
     char resp[BUF_SIZE];
+    uint64_t total_tx = tx;
+    uint64_t total_rx = rx;
+
+    if (worker_stats != NULL) {
+        // publish our own counters, only the first worker reports the sum
+        __atomic_store_n(&worker_stats[worker_id].tx, tx, __ATOMIC_RELAXED);
+        __atomic_store_n(&worker_stats[worker_id].rx, rx, __ATOMIC_RELAXED);
+        if (worker_id != 0) {
+            return;
+        }
+
+        total_tx = total_rx = 0;
+        for (int i = 0; i < worker_num; i++) {
+            total_tx += __atomic_load_n(&worker_stats[i].tx, __ATOMIC_RELAXED);
+            total_rx += __atomic_load_n(&worker_stats[i].rx, __ATOMIC_RELAXED);
+        }
+    }
 
     if (verbose) {
-        LOGI("update traffic stat: tx: %" PRIu64 " rx: %" PRIu64 "", tx, rx);
+        LOGI("update traffic stat: tx: %" PRIu64 " rx: %" PRIu64 "", total_tx, total_rx);
     }
 
-    snprintf(resp, BUF_SIZE, "stat: {\"%s\":%" PRIu64 "}", remote_port, tx + rx);
+    snprintf(resp, BUF_SIZE, "stat: {\"%s\":%" PRIu64 "}", remote_port, total_tx + total_rx);
     msgLen = strlen(resp) + 1;
 
     ss_addr_t ip_addr = { .host = NULL, .port = NULL };
@@ -217,6 +269,152 @@ free_connections(struct ev_loop *loop)
     }
 }
 
+static void
+slab_buf_init(void *user_data, void *value)
+{
+    // the buffer itself is allocated on first use
+    buffer_t *buf = (buffer_t *)((char *)value + (size_t)user_data);
+    memset(buf, 0, sizeof(buffer_t));
+}
+
+static void
+slab_buf_done(void *user_data, void *value)
+{
+    buffer_t *buf = (buffer_t *)((char *)value + (size_t)user_data);
+    bfree(buf);
+}
+
+static struct cork_mempool *
+new_conn_pool(size_t size, size_t buf_ofst)
+{
+    struct cork_mempool *mp = cork_mempool_new_size_ex(size, CONN_POOL_BLOCK_SIZE);
+    cork_mempool_set_user_data(mp, (void *)buf_ofst, NULL);
+    cork_mempool_set_init_object(mp, slab_buf_init);
+    cork_mempool_set_done_object(mp, slab_buf_done);
+    return mp;
+}
+
+static void
+recycle_buf(buffer_t *buf)
+{
+    // don't keep buffers beyond the high-water mark, or that grew far
+    // beyond buf_size, on the free list
+    if (idle_bufs >= CONN_POOL_IDLE_BUFS) {
+        bfree(buf);
+        return;
+    }
+    if (buf->capacity > 2 * buf_size) {
+        bfree(buf);
+        balloc(buf, buf_size);
+    }
+    buf->idx = 0;
+    buf->len = 0;
+    idle_bufs++;
+}
+
+static void
+reuse_buf(buffer_t *buf)
+{
+    if (buf->data == NULL) {
+        balloc(buf, buf_size);
+    } else {
+        idle_bufs--;
+    }
+}
+
+/*
+ * Fork worker processes sharing the salt filter and the traffic counters.
+ * The parent becomes worker 0, each child returns with its own worker_id
+ * and goes on to bind its own SO_REUSEPORT sockets and run its own loop.
+ */
+static void
+start_workers(int num)
+{
+    worker_stats = mmap(NULL, sizeof(worker_stat_t) * num, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANON, -1, 0);
+    if (worker_stats == MAP_FAILED) {
+        FATAL("failed to map worker stats");
+    }
+    memset(worker_stats, 0, sizeof(worker_stat_t) * num);
+
+    worker_pids = ss_malloc(sizeof(pid_t) * num);
+    worker_pids[0] = getpid();
+
+    for (int i = 1; i < num; i++) {
+        pid_t pid = fork();
+        if (pid == -1) {
+            FATAL("failed to fork worker");
+        }
+        if (pid == 0) {
+#ifdef __linux__
+            // do not outlive the first worker
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+            worker_id = i;
+            ss_free(worker_pids);
+            ev_loop_fork(EV_DEFAULT);
+            return;
+        }
+        worker_pids[i] = pid;
+    }
+
+    LOGI("started %d workers", num);
+}
+
+static void
+stop_workers(void)
+{
+    if (worker_stats == NULL) {
+        return;
+    }
+
+    if (worker_id == 0) {
+        for (int i = 1; i < worker_num; i++)
+            if (worker_pids[i] > 0)
+                kill(worker_pids[i], SIGTERM);
+        for (int i = 1; i < worker_num; i++)
+            if (worker_pids[i] > 0)
+                waitpid(worker_pids[i], NULL, 0);
+        ss_free(worker_pids);
+    }
+
+    munmap(worker_stats, sizeof(worker_stat_t) * worker_num);
+    worker_stats = NULL;
+}
+
+/*
+ * Reap the workers that died. A dead worker is not forked again, the rest
+ * keep serving its port. Its last counters move to the first worker so the
+ * traffic reported to the manager does not go backwards, and its slot is
+ * cleared.
+ */
+static void
+reap_workers(void)
+{
+    pid_t pid;
+    int status;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        if (worker_pids == NULL) {
+            continue;
+        }
+        for (int i = 1; i < worker_num; i++) {
+            if (worker_pids[i] != pid) {
+                continue;
+            }
+            if (WIFSIGNALED(status)) {
+                LOGE("worker %d (pid %d) killed by signal %d", i, pid, WTERMSIG(status));
+            } else {
+                LOGE("worker %d (pid %d) exited with status %d", i, pid, WEXITSTATUS(status));
+            }
+            tx += __atomic_exchange_n(&worker_stats[i].tx, 0, __ATOMIC_RELAXED);
+            rx += __atomic_exchange_n(&worker_stats[i].rx, 0, __ATOMIC_RELAXED);
+            worker_pids[i] = 0;
+            break;
+        }
+    }
+}
+
 static char *
 get_peer_name(int fd)
 {
@@ -561,7 +759,7 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
         ev_timer_again(EV_A_ & server->recv_ctx->watcher);
     }
 
-    ssize_t r = recv(server->fd, buf->data, BUF_SIZE, 0);
+    ssize_t r = recv(server->fd, buf->data, buf_size, 0);
 
     if (r == 0) {
         // connection closed
@@ -587,7 +785,7 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
     tx      += r;
     buf->len = r;
 
-    int err = crypto->decrypt(buf, server->d_ctx, BUF_SIZE);
+    int err = crypto->decrypt(buf, server->d_ctx, buf_size);
 
     if (err == CRYPTO_ERROR) {
         report_addr(server->fd, MALICIOUS, "authentication error");
@@ -779,7 +977,7 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
 
                 // XXX: should handle buffer carefully
                 if (server->buf->len > 0) {
-                    brealloc(remote->buf, server->buf->len, BUF_SIZE);
+                    brealloc(remote->buf, server->buf->len, buf_size);
                     memcpy(remote->buf->data, server->buf->data + server->buf->idx,
                            server->buf->len);
                     remote->buf->len = server->buf->len;
@@ -866,6 +1064,22 @@ server_send_cb(EV_P_ ev_io *w, int revents)
     }
 }
 
+static void
+sbf_expire_cb(EV_P_ ev_timer *watcher, int revents)
+{
+    if (fs_sbf_expire(time(NULL)) && verbose) {
+        LOGI("retired the oldest salt filter generation");
+    }
+}
+
+static void
+sbf_flush_cb(EV_P_ ev_timer *watcher, int revents)
+{
+    if (fs_sbf_flush() != 0) {
+        LOGE("failed to flush the salt filter to %s", replay_file);
+    }
+}
+
 static void
 block_list_clear_cb(EV_P_ ev_timer *watcher, int revents)
 {
@@ -945,7 +1159,7 @@ resolv_cb(struct sockaddr *addr, void *data)
 
             // XXX: should handle buffer carefully
             if (server->buf->len > 0) {
-                brealloc(remote->buf, server->buf->len, BUF_SIZE);
+                brealloc(remote->buf, server->buf->len, buf_size);
                 memcpy(remote->buf->data, server->buf->data + server->buf->idx,
                        server->buf->len);
                 remote->buf->len = server->buf->len;
@@ -975,7 +1189,11 @@ remote_recv_cb(EV_P_ ev_io *w, int revents)
 
     ev_timer_again(EV_A_ & server->recv_ctx->watcher);
 
-    ssize_t r = recv(remote->fd, server->buf->data, BUF_SIZE, 0);
+    static cipher_iov_t civ;
+    buffer_t *buf = server->buf;
+    buf->idx = 0;
+
+    ssize_t r = recv(remote->fd, buf->data, buf_size, 0);
 
     if (r == 0) {
         // connection closed
@@ -1000,8 +1218,10 @@ remote_recv_cb(EV_P_ ev_io *w, int revents)
 
     rx += r;
 
-    server->buf->len = r;
-    int err = crypto->encrypt(server->buf, server->e_ctx, BUF_SIZE);
+    buf->len = r;
+
+    // seal all chunks in place and send them with one writev()
+    int err = crypto->encrypt_iov(buf, server->e_ctx, &civ, buf_size);
 
     if (err) {
         LOGE("invalid password or cipher");
@@ -1010,12 +1230,12 @@ remote_recv_cb(EV_P_ ev_io *w, int revents)
         return;
     }
 
-    int s = send(server->fd, server->buf->data, server->buf->len, 0);
+    ssize_t s = writev(server->fd, civ.iov, civ.iovcnt);
 
     if (s == -1) {
         if (errno == EAGAIN || errno == EWOULDBLOCK) {
             // no data, wait for send
-            server->buf->idx = 0;
+            bcollect(buf, &civ, 0, buf_size);
             ev_io_stop(EV_A_ & remote_recv_ctx->io);
             ev_io_start(EV_A_ & server->send_ctx->io);
         } else {
@@ -1024,11 +1244,12 @@ remote_recv_cb(EV_P_ ev_io *w, int revents)
             close_and_free_server(EV_A_ server);
             return;
         }
-    } else if (s < server->buf->len) {
-        server->buf->len -= s;
-        server->buf->idx  = s;
+    } else if (s < civ.len) {
+        bcollect(buf, &civ, s, buf_size);
         ev_io_stop(EV_A_ & remote_recv_ctx->io);
         ev_io_start(EV_A_ & server->send_ctx->io);
+    } else {
+        buf->len = 0;
     }
 
     // Disable TCP_NODELAY after the first response are sent
@@ -1136,13 +1357,14 @@ new_remote(int fd)
         remote_conn++;
     }
 
-    remote_t *remote = ss_malloc(sizeof(remote_t));
+    remote_slab_t *slab = cork_mempool_new_object(remote_pool);
+    remote_t *remote    = &slab->remote;
     memset(remote, 0, sizeof(remote_t));
 
-    remote->recv_ctx = ss_malloc(sizeof(remote_ctx_t));
-    remote->send_ctx = ss_malloc(sizeof(remote_ctx_t));
-    remote->buf      = ss_malloc(sizeof(buffer_t));
-    balloc(remote->buf, BUF_SIZE);
+    remote->recv_ctx = &slab->recv_ctx;
+    remote->send_ctx = &slab->send_ctx;
+    remote->buf      = &slab->buf;
+    reuse_buf(remote->buf);
     memset(remote->recv_ctx, 0, sizeof(remote_ctx_t));
     memset(remote->send_ctx, 0, sizeof(remote_ctx_t));
     remote->fd                  = fd;
@@ -1164,13 +1386,8 @@ free_remote(remote_t *remote)
     if (remote->server != NULL) {
         remote->server->remote = NULL;
     }
-    if (remote->buf != NULL) {
-        bfree(remote->buf);
-        ss_free(remote->buf);
-    }
-    ss_free(remote->recv_ctx);
-    ss_free(remote->send_ctx);
-    ss_free(remote);
+    recycle_buf(remote->buf);
+    cork_mempool_free_object(remote_pool, remote);
 }
 
 static void
@@ -1195,17 +1412,17 @@ new_server(int fd, listen_ctx_t *listener)
         server_conn++;
     }
 
-    server_t *server;
-    server = ss_malloc(sizeof(server_t));
+    server_slab_t *slab = cork_mempool_new_object(server_pool);
+    server_t *server    = &slab->server;
 
     memset(server, 0, sizeof(server_t));
 
-    server->recv_ctx = ss_malloc(sizeof(server_ctx_t));
-    server->send_ctx = ss_malloc(sizeof(server_ctx_t));
-    server->buf      = ss_malloc(sizeof(buffer_t));
+    server->recv_ctx = &slab->recv_ctx;
+    server->send_ctx = &slab->send_ctx;
+    server->buf      = &slab->buf;
+    reuse_buf(server->buf);
     memset(server->recv_ctx, 0, sizeof(server_ctx_t));
     memset(server->send_ctx, 0, sizeof(server_ctx_t));
-    balloc(server->buf, BUF_SIZE);
     server->fd                  = fd;
     server->recv_ctx->server    = server;
     server->recv_ctx->connected = 0;
@@ -1217,8 +1434,8 @@ new_server(int fd, listen_ctx_t *listener)
     server->listen_ctx          = listener;
     server->remote              = NULL;
 
-    server->e_ctx = ss_align(sizeof(cipher_ctx_t));
-    server->d_ctx = ss_align(sizeof(cipher_ctx_t));
+    server->e_ctx = &slab->e_ctx;
+    server->d_ctx = &slab->d_ctx;
     crypto->ctx_init(crypto->cipher, server->e_ctx, 1);
     crypto->ctx_init(crypto->cipher, server->d_ctx, 0);
 
@@ -1243,22 +1460,11 @@ free_server(server_t *server)
     if (server->remote != NULL) {
         server->remote->server = NULL;
     }
-    if (server->e_ctx != NULL) {
-        crypto->ctx_release(server->e_ctx);
-        ss_free(server->e_ctx);
-    }
-    if (server->d_ctx != NULL) {
-        crypto->ctx_release(server->d_ctx);
-        ss_free(server->d_ctx);
-    }
-    if (server->buf != NULL) {
-        bfree(server->buf);
-        ss_free(server->buf);
-    }
+    crypto->ctx_release(server->e_ctx);
+    crypto->ctx_release(server->d_ctx);
+    recycle_buf(server->buf);
 
-    ss_free(server->recv_ctx);
-    ss_free(server->send_ctx);
-    ss_free(server);
+    cork_mempool_free_object(server_pool, server);
 }
 
 static void
@@ -1287,6 +1493,9 @@ signal_cb(EV_P_ ev_signal *w, int revents)
     if (revents & EV_SIGNAL) {
         switch (w->signum) {
         case SIGCHLD:
+            if (worker_id == 0) {
+                reap_workers();
+            }
             return;
         case SIGINT:
         case SIGTERM:
@@ -1354,6 +1563,7 @@ main(int argc, char **argv)
     int i, c;
     int pid_flags   = 0;
     int mptcp       = 0;
+    int udp_offload = 0;
     int mtu         = 0;
     char *user      = NULL;
     char *password  = NULL;
@@ -1378,6 +1588,13 @@ main(int argc, char **argv)
         { "manager-address", required_argument, NULL, GETOPT_VAL_MANAGER_ADDRESS },
         { "mtu",             required_argument, NULL, GETOPT_VAL_MTU             },
         { "password",        required_argument, NULL, GETOPT_VAL_PASSWORD        },
+        { "buffer-size",     required_argument, NULL, GETOPT_VAL_BUFFER_SIZE     },
+        { "workers",         required_argument, NULL, GETOPT_VAL_WORKERS         },
+        { "replay-window",   required_argument, NULL, GETOPT_VAL_REPLAY_WINDOW   },
+        { "replay-file",     required_argument, NULL, GETOPT_VAL_REPLAY_FILE     },
+        { "udp-offload",     no_argument,       NULL, GETOPT_VAL_UDP_OFFLOAD     },
+        { "udp-pool",        required_argument, NULL, GETOPT_VAL_UDP_POOL        },
+        { "bench-ciphers",   no_argument,       NULL, GETOPT_VAL_BENCH_CIPHERS   },
         { "help",            no_argument,       NULL, GETOPT_VAL_HELP            },
 #ifdef __linux__
         { "mptcp",           no_argument,       NULL, GETOPT_VAL_MPTCP           },
@@ -1406,6 +1623,9 @@ main(int argc, char **argv)
         case GETOPT_VAL_MANAGER_ADDRESS:
             manager_addr = optarg;
             break;
+        case GETOPT_VAL_BUFFER_SIZE:
+            buf_size = atoi(optarg);
+            break;
         case GETOPT_VAL_MTU:
             mtu = atoi(optarg);
             LOGI("set MTU to %d", mtu);
@@ -1414,6 +1634,24 @@ main(int argc, char **argv)
             mptcp = 1;
             LOGI("enable multipath TCP");
             break;
+        case GETOPT_VAL_UDP_OFFLOAD:
+            udp_offload = 1;
+            break;
+        case GETOPT_VAL_UDP_POOL:
+            udp_pool = atoi(optarg);
+            break;
+        case GETOPT_VAL_BENCH_CIPHERS:
+            crypto_bench_ciphers(CRYPTO_BENCH_TIME);
+            exit(EXIT_SUCCESS);
+        case GETOPT_VAL_WORKERS:
+            worker_num = atoi(optarg);
+            break;
+        case GETOPT_VAL_REPLAY_WINDOW:
+            replay_window = atoi(optarg);
+            break;
+        case GETOPT_VAL_REPLAY_FILE:
+            replay_file = optarg;
+            break;
         case 's':
             if (server_num < MAX_REMOTE_NUM) {
                 server_host[server_num++] = optarg;
@@ -1519,9 +1757,18 @@ main(int argc, char **argv)
         if (mtu == 0) {
             mtu = conf->mtu;
         }
+        if (buf_size == BUF_SIZE && conf->buffer_size > 0) {
+            buf_size = conf->buffer_size;
+        }
         if (mptcp == 0) {
             mptcp = conf->mptcp;
         }
+        if (udp_offload == 0) {
+            udp_offload = conf->udp_offload;
+        }
+        if (udp_pool == 0) {
+            udp_pool = conf->udp_pool;
+        }
 #ifdef TCP_FASTOPEN
         if (fast_open == 0) {
             fast_open = conf->fast_open;
@@ -1541,6 +1788,23 @@ main(int argc, char **argv)
         if (ipv6first == 0) {
             ipv6first = conf->ipv6_first;
         }
+        if (worker_num == 1 && conf->workers > 0) {
+            worker_num = conf->workers;
+        }
+        if (replay_window == FS_BF_REPLAY_WINDOW && conf->replay_window > 0) {
+            replay_window = conf->replay_window;
+        }
+        if (replay_file == NULL) {
+            replay_file = conf->replay_file;
+        }
+    }
+
+    if (worker_num < 1) {
+        worker_num = 1;
+    }
+
+    if (replay_window < 1) {
+        replay_window = FS_BF_REPLAY_WINDOW;
     }
 
     if (server_num == 0) {
@@ -1562,6 +1826,11 @@ main(int argc, char **argv)
         timeout = "60";
     }
 
+    if (buf_size < MIN_BUF_SIZE || buf_size > MAX_BUF_SIZE) {
+        buf_size = max(MIN_BUF_SIZE, min(buf_size, MAX_BUF_SIZE));
+        LOGE("buffer size out of range, using %d", buf_size);
+    }
+
 #ifdef HAVE_SETRLIMIT
     /*
      * no need to check the return value here since we will show
@@ -1614,13 +1883,25 @@ main(int argc, char **argv)
 
     // setup keys
     LOGI("initializing ciphers... %s", method);
+    fs_sbf_set_shared(worker_num > 1);
+    fs_sbf_set_window(replay_window);
+    fs_sbf_set_path(replay_file);
     crypto = crypto_init(password, method);
     if (crypto == NULL)
         FATAL("failed to initialize ciphers");
 
+    // fork workers, everything below is per worker
+    if (worker_num > 1) {
+        start_workers(worker_num);
+    }
+
     // initialize ev loop
     struct ev_loop *loop = EV_DEFAULT;
 
+    // setup connection pools
+    server_pool = new_conn_pool(sizeof(server_slab_t), offsetof(server_slab_t, buf));
+    remote_pool = new_conn_pool(sizeof(remote_slab_t), offsetof(remote_slab_t, buf));
+
     // setup c-ares
     resolv_init(loop, nameservers,
                 ipv6first ? RESOLV_MODE_IPV6_FIRST : RESOLV_MODE_IPV4_ONLY);
@@ -1674,7 +1955,7 @@ main(int argc, char **argv)
             else
                 LOGI("udp server listening at %s:%s", host ? host : "0.0.0.0", port);
             // Setup UDP
-            init_udprelay(host, port, mtu, crypto, atoi(timeout), iface);
+            init_udprelay(host, port, mtu, udp_offload, crypto, atoi(timeout), iface);
         }
     }
 
@@ -1687,6 +1968,20 @@ main(int argc, char **argv)
     block_list_watcher.repeat = UPDATE_INTERVAL + randombytes_uniform(UPDATE_INTERVAL);
     ev_timer_again(EV_DEFAULT, &block_list_watcher);
 
+    // the salt filter ring is shared, only one worker rotates it
+    if (worker_id == 0) {
+        double interval = max(replay_window / (FS_BF_GENERATIONS - 1), 1);
+        interval = min(interval, UPDATE_INTERVAL);
+        ev_timer_init(&sbf_expire_watcher, sbf_expire_cb, interval, interval);
+        ev_timer_start(EV_DEFAULT, &sbf_expire_watcher);
+
+        if (replay_file != NULL) {
+            ev_timer_init(&sbf_flush_watcher, sbf_flush_cb,
+                          FS_BF_FLUSH_INTERVAL, FS_BF_FLUSH_INTERVAL);
+            ev_timer_start(EV_DEFAULT, &sbf_flush_watcher);
+        }
+    }
+
     // setuid
     if (user != NULL && !run_as(user)) {
         FATAL("failed to switch user");
@@ -1724,6 +2019,13 @@ main(int argc, char **argv)
 
     ev_timer_stop(EV_DEFAULT, &block_list_watcher);
 
+    if (worker_id == 0) {
+        ev_timer_stop(EV_DEFAULT, &sbf_expire_watcher);
+        if (replay_file != NULL) {
+            ev_timer_stop(EV_DEFAULT, &sbf_flush_watcher);
+        }
+    }
+
     // Clean up
 
     resolv_shutdown(loop);
@@ -1744,5 +2046,10 @@ main(int argc, char **argv)
         free_udprelay();
     }
 
+    cork_mempool_free(server_pool);
+    cork_mempool_free(remote_pool);
+
+    stop_workers();
+
     return 0;
 }
@@ -88,4 +88,24 @@ typedef struct remote {
     struct server *server;
 } remote_t;
 
+/*
+ * A connection is carved out of a pool in one piece, together with its
+ * watchers, buffer and cipher contexts.
+ */
+typedef struct server_slab {
+    server_t server;
+    server_ctx_t recv_ctx;
+    server_ctx_t send_ctx;
+    buffer_t buf;
+    cipher_ctx_t e_ctx;
+    cipher_ctx_t d_ctx;
+} server_slab_t;
+
+typedef struct remote_slab {
+    remote_t remote;
+    remote_ctx_t recv_ctx;
+    remote_ctx_t send_ctx;
+    buffer_t buf;
+} remote_slab_t;
+
 #endif // _SERVER_H
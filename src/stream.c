@@ -396,6 +396,12 @@ stream_encrypt(buffer_t *plaintext, cipher_ctx_t *cipher_ctx, size_t capacity)
 
     static buffer_t tmp = { 0, 0, 0, NULL };
 
+    // stream ciphers do not use the headroom, start from data[0]
+    if (plaintext->idx > 0) {
+        memmove(plaintext->data, plaintext->data + plaintext->idx, plaintext->len);
+        plaintext->idx = 0;
+    }
+
     int err          = CRYPTO_OK;
     size_t nonce_len = 0;
     if (!cipher_ctx->init) {
@@ -518,6 +524,27 @@ stream_decrypt_all(buffer_t *ciphertext, cipher_t *cipher, size_t capacity)
     return CRYPTO_OK;
 }
 
+/*
+ * Stream ciphers have no framing to split off, so encrypt as usual and
+ * describe the result with a single iovec.
+ */
+int
+stream_encrypt_iov(buffer_t *plaintext, cipher_ctx_t *cipher_ctx,
+                   cipher_iov_t *civ, size_t capacity)
+{
+    int err = stream_encrypt(plaintext, cipher_ctx, capacity);
+
+    if (err)
+        return err;
+
+    civ->iov[0].iov_base = plaintext->data + plaintext->idx;
+    civ->iov[0].iov_len  = plaintext->len;
+    civ->iovcnt          = 1;
+    civ->len             = plaintext->len;
+
+    return CRYPTO_OK;
+}
+
 int
 stream_decrypt(buffer_t *ciphertext, cipher_ctx_t *cipher_ctx, size_t capacity)
 {
@@ -566,15 +593,13 @@ stream_decrypt(buffer_t *ciphertext, cipher_ctx_t *cipher_ctx, size_t capacity)
 
         if (cipher->method >= RC4_MD5) {
 #ifdef MODULE_REMOTE
-            err = fs_sbf_check((void *)nonce, nonce_len);
+            err = fs_sbf_check_and_add((void *)nonce, nonce_len);
             if (err == 1) {
                 LOGE("crypto: stream: repeat IV detected");
                 return CRYPTO_ERROR;
             } else if (err < 0) {
                 LOGE("crypto: stream: fail to check IV");
             }
-            if (fs_sbf_add((void *)cipher_ctx->nonce, cipher->nonce_len) < 0)
-                LOGE("crypto: stream: fail to add IV");
 #endif
         }
     }
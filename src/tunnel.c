@@ -94,6 +94,7 @@ static int mode      = TCP_ONLY;
 static int nofile = 0;
 #endif
 static int no_delay = 0;
+static int buf_size = BUF_SIZE;
 
 static struct ev_signal sigint_watcher;
 static struct ev_signal sigterm_watcher;
@@ -187,7 +188,7 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
         return;
     }
 
-    ssize_t r = recv(server->fd, remote->buf->data, BUF_SIZE, 0);
+    ssize_t r = recv(server->fd, remote->buf->data, buf_size, 0);
 
     if (r == 0) {
         // connection closed
@@ -209,7 +210,7 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
 
     remote->buf->len = r;
 
-    int err = crypto->encrypt(remote->buf, server->e_ctx, BUF_SIZE);
+    int err = crypto->encrypt(remote->buf, server->e_ctx, buf_size);
 
     if (err) {
         LOGE("invalid password or cipher");
@@ -220,7 +221,7 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
 
     if (server->abuf != NULL) {
         ev_timer_stop(EV_A_ & server->delayed_connect_watcher);
-        bprepend(remote->buf, server->abuf, BUF_SIZE);
+        bprepend(remote->buf, server->abuf, buf_size);
         bfree(server->abuf);
         ss_free(server->abuf);
         server->abuf = NULL;
@@ -319,7 +320,7 @@ remote_recv_cb(EV_P_ ev_io *w, int revents)
     remote_t *remote              = remote_recv_ctx->remote;
     server_t *server              = remote->server;
 
-    ssize_t r = recv(remote->fd, server->buf->data, BUF_SIZE, 0);
+    ssize_t r = recv(remote->fd, server->buf->data, buf_size, 0);
 
     if (r == 0) {
         // connection closed
@@ -341,7 +342,7 @@ remote_recv_cb(EV_P_ ev_io *w, int revents)
 
     server->buf->len = r;
 
-    int err = crypto->decrypt(server->buf, server->d_ctx, BUF_SIZE);
+    int err = crypto->decrypt(server->buf, server->d_ctx, buf_size);
     if (err == CRYPTO_ERROR) {
         LOGE("invalid password or cipher");
         close_and_free_remote(EV_A_ remote);
@@ -400,7 +401,7 @@ remote_send_cb(EV_P_ ev_io *w, int revents)
 
             server->abuf = (buffer_t *)ss_malloc(sizeof(buffer_t));
             buffer_t *abuf = server->abuf;
-            balloc(abuf, BUF_SIZE);
+            balloc(abuf, buf_size);
 
             ss_addr_t *sa = &server->destaddr;
             struct cork_ip ip;
@@ -446,7 +447,7 @@ remote_send_cb(EV_P_ ev_io *w, int revents)
             memcpy(abuf->data + abuf->len, &port, 2);
             abuf->len += 2;
 
-            int err = crypto->encrypt(abuf, server->e_ctx, BUF_SIZE);
+            int err = crypto->encrypt(abuf, server->e_ctx, buf_size);
 
             if (err) {
                 bfree(abuf);
@@ -478,7 +479,7 @@ remote_send_cb(EV_P_ ev_io *w, int revents)
             // has data to send
             if (server->abuf != NULL) {
                 assert(remote->buf->len == 0);
-                bprepend(remote->buf, server->abuf, BUF_SIZE);
+                bprepend(remote->buf, server->abuf, buf_size);
                 bfree(server->abuf);
                 ss_free(server->abuf);
                 server->abuf = NULL;
@@ -518,7 +519,7 @@ new_remote(int fd, int timeout)
     remote->recv_ctx = ss_malloc(sizeof(remote_ctx_t));
     remote->send_ctx = ss_malloc(sizeof(remote_ctx_t));
     remote->buf      = ss_malloc(sizeof(buffer_t));
-    balloc(remote->buf, BUF_SIZE);
+    balloc(remote->buf, buf_size);
     memset(remote->recv_ctx, 0, sizeof(remote_ctx_t));
     memset(remote->send_ctx, 0, sizeof(remote_ctx_t));
     remote->fd                  = fd;
@@ -571,7 +572,7 @@ new_server(int fd)
     server->recv_ctx = ss_malloc(sizeof(server_ctx_t));
     server->send_ctx = ss_malloc(sizeof(server_ctx_t));
     server->buf      = ss_malloc(sizeof(buffer_t));
-    balloc(server->buf, BUF_SIZE);
+    balloc(server->buf, buf_size);
     memset(server->recv_ctx, 0, sizeof(server_ctx_t));
     memset(server->send_ctx, 0, sizeof(server_ctx_t));
     server->fd                  = fd;
@@ -754,6 +755,7 @@ main(int argc, char **argv)
     int i, c;
     int pid_flags    = 0;
     int mptcp        = 0;
+    int udp_offload  = 0;
     int mtu          = 0;
     char *user       = NULL;
     char *local_port = NULL;
@@ -773,12 +775,14 @@ main(int argc, char **argv)
     char *tunnel_addr_str = NULL;
 
     static struct option long_options[] = {
-        { "mtu",      required_argument, NULL, GETOPT_VAL_MTU      },
-        { "no-delay", no_argument,       NULL, GETOPT_VAL_NODELAY  },
-        { "mptcp",    no_argument,       NULL, GETOPT_VAL_MPTCP    },
-        { "password", required_argument, NULL, GETOPT_VAL_PASSWORD },
-        { "help",     no_argument,       NULL, GETOPT_VAL_HELP     },
-        { NULL,                       0, NULL,                   0 }
+        { "mtu",         required_argument, NULL, GETOPT_VAL_MTU         },
+        { "no-delay",    no_argument,       NULL, GETOPT_VAL_NODELAY     },
+        { "mptcp",       no_argument,       NULL, GETOPT_VAL_MPTCP       },
+        { "password",    required_argument, NULL, GETOPT_VAL_PASSWORD    },
+        { "buffer-size", required_argument, NULL, GETOPT_VAL_BUFFER_SIZE },
+        { "udp-offload", no_argument,       NULL, GETOPT_VAL_UDP_OFFLOAD },
+        { "help",        no_argument,       NULL, GETOPT_VAL_HELP        },
+        { NULL,                          0, NULL,                      0 }
     };
 
     opterr = 0;
@@ -793,6 +797,9 @@ main(int argc, char **argv)
                             long_options, NULL)) != -1) {
 #endif
         switch (c) {
+        case GETOPT_VAL_BUFFER_SIZE:
+            buf_size = atoi(optarg);
+            break;
         case GETOPT_VAL_MTU:
             mtu = atoi(optarg);
             LOGI("set MTU to %d", mtu);
@@ -805,6 +812,9 @@ main(int argc, char **argv)
             mptcp = 1;
             LOGI("enable multipath TCP");
             break;
+        case GETOPT_VAL_UDP_OFFLOAD:
+            udp_offload = 1;
+            break;
         case 's':
             if (remote_num < MAX_REMOTE_NUM) {
                 remote_addr[remote_num].host   = optarg;
@@ -928,9 +938,15 @@ main(int argc, char **argv)
         if (mtu == 0) {
             mtu = conf->mtu;
         }
+        if (buf_size == BUF_SIZE && conf->buffer_size > 0) {
+            buf_size = conf->buffer_size;
+        }
         if (mptcp == 0) {
             mptcp = conf->mptcp;
         }
+        if (udp_offload == 0) {
+            udp_offload = conf->udp_offload;
+        }
 #ifdef HAVE_SETRLIMIT
         if (nofile == 0) {
             nofile = conf->nofile;
@@ -952,6 +968,11 @@ main(int argc, char **argv)
         timeout = "60";
     }
 
+    if (buf_size < MIN_BUF_SIZE || buf_size > MAX_BUF_SIZE) {
+        buf_size = max(MIN_BUF_SIZE, min(buf_size, MAX_BUF_SIZE));
+        LOGE("buffer size out of range, using %d", buf_size);
+    }
+
 #ifdef HAVE_SETRLIMIT
     /*
      * no need to check the return value here since we will show
@@ -1057,7 +1078,7 @@ main(int argc, char **argv)
         }
         struct sockaddr *addr = (struct sockaddr *)storage;
         init_udprelay(local_addr, local_port, addr, get_sockaddr_len(addr),
-                      tunnel_addr, mtu, crypto, listen_ctx.timeout, iface);
+                      tunnel_addr, mtu, udp_offload, crypto, listen_ctx.timeout, iface);
     }
 
     if (mode == UDP_ONLY) {
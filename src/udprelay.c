@@ -51,7 +51,6 @@
 
 #include "utils.h"
 #include "netutils.h"
-#include "cache.h"
 #include "udprelay.h"
 
 #ifdef MODULE_REMOTE
@@ -60,6 +59,13 @@
 #define MAX_UDP_CONN_NUM 256
 #endif
 
+// Remotes on pool sockets cost no fd, so many more of them fit; those with
+// a socket of their own are still held to MAX_UDP_CONN_NUM
+#define MAX_UDP_POOL_CONN_NUM 65536
+
+// Peer keys store the index of a pool socket in one byte
+#define MAX_UDP_POOL_SIZE 64
+
 #ifdef MODULE_REMOTE
 #ifdef MODULE_
 #error "MODULE_REMOTE and MODULE_LOCAL should not be both defined"
@@ -76,9 +82,11 @@
 
 static void server_recv_cb(EV_P_ ev_io *w, int revents);
 static void remote_recv_cb(EV_P_ ev_io *w, int revents);
-static void remote_timeout_cb(EV_P_ ev_timer *watcher, int revents);
+static void remote_expire_cb(EV_P_ ev_timer *watcher, int revents);
+#ifdef MODULE_REMOTE
+static void pool_recv_cb(EV_P_ ev_io *w, int revents);
+#endif
 
-static char *hash_key(const int af, const struct sockaddr_storage *addr);
 #ifdef MODULE_REMOTE
 static void resolv_free_cb(void *data);
 static void resolv_cb(struct sockaddr *addr, void *data);
@@ -98,6 +106,7 @@ extern int verbose;
 extern uint64_t tx;
 extern uint64_t rx;
 extern char *local_addr;
+extern int udp_pool;
 #endif
 
 static int packet_size                               = DEFAULT_PACKET_SIZE;
@@ -105,6 +114,375 @@ static int buf_size                                  = DEFAULT_PACKET_SIZE * 2;
 static int server_num                                = 0;
 static server_ctx_t *server_ctx_list[MAX_REMOTE_NUM] = { NULL };
 
+#ifdef USE_UDP_OFFLOAD
+static int udp_gso = 0;
+static int udp_gro = 0;
+#endif
+
+/*
+ * A server and its remotes receive into the packet buffers of the server
+ * context, and the datagrams are handled before the next batch is read.
+ * Packets sent on the same socket while handling a batch are queued and go
+ * out together with sendmmsg() once the batch is done, or once the socket
+ * changes.
+ */
+static void
+init_udp_batch(udp_batch_t *batch, udp_sendq_t *sendq)
+{
+    int i;
+
+    memset(batch, 0, sizeof(udp_batch_t));
+    memset(sendq, 0, sizeof(udp_sendq_t));
+
+    for (i = 0; i < UDP_BATCH_SIZE; i++) {
+        balloc(&batch->buf[i], buf_size);
+        batch->msgs[i].msg_hdr.msg_name   = &batch->addr[i];
+        batch->msgs[i].msg_hdr.msg_iov    = &batch->iov[i];
+        batch->msgs[i].msg_hdr.msg_iovlen = 1;
+#ifdef MODULE_REDIR
+        batch->msgs[i].msg_hdr.msg_control = batch->control[i];
+#endif
+        sendq->msgs[i].msg_hdr.msg_name = &sendq->addr[i];
+    }
+
+#ifdef USE_UDP_OFFLOAD
+    if (udp_gro) {
+        for (i = 0; i < UDP_GRO_TRAINS; i++) {
+            // a train is at most 64 KB, headers included
+            balloc(&batch->gro[i], 65535);
+            batch->gro_iov[i].iov_base = batch->gro[i].data;
+            batch->gro_iov[i].iov_len  = batch->gro[i].capacity;
+            batch->gro_msgs[i].msg_hdr.msg_name    = &batch->gro_addr[i];
+            batch->gro_msgs[i].msg_hdr.msg_iov     = &batch->gro_iov[i];
+            batch->gro_msgs[i].msg_hdr.msg_iovlen  = 1;
+            batch->gro_msgs[i].msg_hdr.msg_control = batch->gro_control[i];
+        }
+    }
+#endif
+}
+
+static void
+free_udp_batch(udp_batch_t *batch)
+{
+    int i;
+
+    for (i = 0; i < UDP_BATCH_SIZE; i++) {
+        bfree(&batch->buf[i]);
+    }
+#ifdef USE_UDP_OFFLOAD
+    for (i = 0; i < UDP_GRO_TRAINS; i++) {
+        bfree(&batch->gro[i]);
+    }
+#endif
+}
+
+#ifdef USE_UDP_OFFLOAD
+/*
+ * Enables GRO on a socket. GSO needs no socket option, but the kernels that
+ * know UDP_SEGMENT also accept it as one, which tells us the segment size
+ * control message will not be silently ignored.
+ */
+static void
+set_udp_offload(int fd)
+{
+    int opt = 0;
+
+    if (udp_gso && setsockopt(fd, SOL_UDP, UDP_SEGMENT, &opt, sizeof(opt)) == -1) {
+        ERROR("[udp] setsockopt UDP_SEGMENT");
+        LOGI("[udp] GSO disabled");
+        udp_gso = 0;
+    }
+
+    opt = 1;
+    if (udp_gro && setsockopt(fd, SOL_UDP, UDP_GRO, &opt, sizeof(opt)) == -1) {
+        ERROR("[udp] setsockopt UDP_GRO");
+        LOGI("[udp] GRO disabled");
+        udp_gro = 0;
+    }
+}
+
+/*
+ * Returns the size of the segments of a GRO train of len bytes. Without
+ * the control message, it is a single datagram.
+ */
+static size_t
+udp_gro_size(struct msghdr *msg, size_t len)
+{
+    struct cmsghdr *cmsg;
+
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+            int gso_size;
+            memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+            if (gso_size > 0) {
+                return gso_size;
+            }
+            break;
+        }
+    }
+
+    return len;
+}
+
+/*
+ * Reads up to UDP_GRO_TRAINS GRO trains with one recvmmsg(), from one peer
+ * each, and splits them into the batch, one segment per buffer. Every
+ * segment is a datagram of its own, with its own AEAD framing. Segments
+ * that do not fit are left for the next call, see udp_recv_pending().
+ */
+static int
+udp_recv_gro(udp_batch_t *batch, int fd)
+{
+    int i, n = 0;
+
+    if (batch->gro_next >= batch->gro_num) {
+        for (i = 0; i < UDP_GRO_TRAINS; i++) {
+            struct msghdr *msg = &batch->gro_msgs[i].msg_hdr;
+            msg->msg_namelen    = sizeof(struct sockaddr_storage);
+            msg->msg_controllen = sizeof(batch->gro_control[i]);
+            msg->msg_flags      = 0;
+        }
+
+        int r = recvmmsg(fd, batch->gro_msgs, UDP_GRO_TRAINS, 0, NULL);
+        if (r == -1) {
+            return -1;
+        }
+
+        for (i = 0; i < r; i++) {
+            struct msghdr *msg = &batch->gro_msgs[i].msg_hdr;
+            // addresses are hashed and compared as a whole
+            memset((char *)msg->msg_name + msg->msg_namelen, 0,
+                   sizeof(struct sockaddr_storage) - msg->msg_namelen);
+            batch->gro_seg[i] = udp_gro_size(msg, batch->gro_msgs[i].msg_len);
+        }
+        batch->gro_num  = r;
+        batch->gro_next = 0;
+        batch->gro_off  = 0;
+    }
+
+    while (batch->gro_next < batch->gro_num && n < UDP_BATCH_SIZE) {
+        int t      = batch->gro_next;
+        size_t r   = batch->gro_msgs[t].msg_len;
+        size_t len = min(batch->gro_seg[t], r - batch->gro_off);
+
+        if (len > 0) {
+            brealloc(&batch->buf[n], len, buf_size);
+            memcpy(batch->buf[n].data, batch->gro[t].data + batch->gro_off, len);
+            batch->buf[n].idx = 0;
+            batch->buf[n].len = len;
+            memcpy(&batch->addr[n], &batch->gro_addr[t], sizeof(struct sockaddr_storage));
+            batch->msgs[n].msg_hdr.msg_namelen = batch->gro_msgs[t].msg_hdr.msg_namelen;
+            batch->gro_off += len;
+            n++;
+        }
+
+        if (batch->gro_off >= r) {
+            batch->gro_next++;
+            batch->gro_off = 0;
+        }
+    }
+
+    return n;
+}
+#endif
+
+/*
+ * Reads up to UDP_BATCH_SIZE datagrams into the batch.
+ * Returns the number read, or -1 on error.
+ */
+static int
+udp_recv_batch(udp_batch_t *batch, int fd)
+{
+    int i, n;
+
+#ifdef USE_UDP_OFFLOAD
+    if (batch->gro[0].data != NULL && udp_gro) {
+        return udp_recv_gro(batch, fd);
+    }
+#endif
+
+    for (i = 0; i < UDP_BATCH_SIZE; i++) {
+        struct msghdr *msg = &batch->msgs[i].msg_hdr;
+        batch->iov[i].iov_base = batch->buf[i].data;
+        batch->iov[i].iov_len  = buf_size;
+        msg->msg_namelen = sizeof(struct sockaddr_storage);
+        msg->msg_flags   = 0;
+#ifdef MODULE_REDIR
+        msg->msg_controllen = sizeof(batch->control[i]);
+#endif
+    }
+
+#ifdef USE_MMSG
+    n = recvmmsg(fd, batch->msgs, UDP_BATCH_SIZE, 0, NULL);
+#else
+    ssize_t r = recvmsg(fd, &batch->msgs[0].msg_hdr, 0);
+    batch->msgs[0].msg_len = r;
+    n = r == -1 ? -1 : 1;
+#endif
+
+    for (i = 0; i < n; i++) {
+        struct msghdr *msg = &batch->msgs[i].msg_hdr;
+        // addresses are hashed and compared as a whole
+        memset((char *)msg->msg_name + msg->msg_namelen, 0,
+               sizeof(struct sockaddr_storage) - msg->msg_namelen);
+        batch->buf[i].idx = 0;
+        batch->buf[i].len = batch->msgs[i].msg_len;
+    }
+
+    return n;
+}
+
+/*
+ * Returns 1 if the datagrams of the last read did not all fit the batch,
+ * the caller then handles this batch and reads the rest from the same fd.
+ */
+static int
+udp_recv_pending(udp_batch_t *batch)
+{
+#ifdef USE_UDP_OFFLOAD
+    return batch->gro_next < batch->gro_num;
+#else
+    return 0;
+#endif
+}
+
+#ifdef USE_UDP_OFFLOAD
+/*
+ * Sends the segments of a message one by one, for when the kernel refuses
+ * the train, e.g. because a segment does not fit the path MTU.
+ */
+static void
+udp_send_segments(int fd, struct msghdr *msg)
+{
+    size_t i;
+
+    for (i = 0; i < msg->msg_iovlen; i++) {
+        if (sendto(fd, msg->msg_iov[i].iov_base, msg->msg_iov[i].iov_len, 0,
+                   msg->msg_name, msg->msg_namelen) == -1) {
+            ERROR("[udp] sendto");
+        }
+    }
+}
+#endif
+
+static void
+udp_flush_sendq(udp_sendq_t *sendq)
+{
+#ifdef USE_MMSG
+    int sent = 0;
+
+#ifdef USE_UDP_OFFLOAD
+    int i;
+    for (i = 0; i < sendq->num; i++) {
+        struct msghdr *msg = &sendq->msgs[i].msg_hdr;
+        if (msg->msg_iovlen > 1) {
+            uint16_t seg = msg->msg_iov[0].iov_len;
+            msg->msg_control    = sendq->control[i];
+            msg->msg_controllen = sizeof(sendq->control[i]);
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type  = UDP_SEGMENT;
+            cmsg->cmsg_len   = CMSG_LEN(sizeof(seg));
+            memcpy(CMSG_DATA(cmsg), &seg, sizeof(seg));
+        } else {
+            msg->msg_control    = NULL;
+            msg->msg_controllen = 0;
+        }
+    }
+#endif
+
+    while (sent < sendq->num) {
+        int s = sendmmsg(sendq->fd, sendq->msgs + sent, sendq->num - sent, 0);
+        if (s == -1) {
+#ifdef USE_UDP_OFFLOAD
+            struct msghdr *msg = &sendq->msgs[sent].msg_hdr;
+            if (msg->msg_iovlen > 1 && (errno == EINVAL || errno == EIO)) {
+                udp_send_segments(sendq->fd, msg);
+                sent++;
+                continue;
+            }
+#endif
+            // drop the datagram that failed, and go on with the others
+            ERROR("[udp] sendmmsg");
+            sent++;
+        } else {
+            sent += s;
+        }
+    }
+    sendq->num    = 0;
+    sendq->iovcnt = 0;
+#endif
+}
+
+#ifdef USE_UDP_OFFLOAD
+/*
+ * Returns 1 if a datagram can join the last queued message as one more
+ * GSO segment: same socket and address, every segment so far of the same
+ * size, and this one not larger.
+ */
+static int
+udp_can_coalesce(udp_sendq_t *sendq, int fd, size_t len,
+                 const struct sockaddr *addr, socklen_t addr_len)
+{
+    if (!udp_gso || sendq->num == 0 || sendq->fd != fd) {
+        return 0;
+    }
+
+    struct msghdr *msg = &sendq->msgs[sendq->num - 1].msg_hdr;
+    size_t seg         = msg->msg_iov[0].iov_len;
+
+    return msg->msg_iovlen < UDP_MAX_SEGMENTS
+           && msg->msg_iov[msg->msg_iovlen - 1].iov_len == seg
+           && len <= seg
+           && seg * msg->msg_iovlen + len <= MAX_UDP_PACKET_SIZE
+           && msg->msg_namelen == addr_len
+           && (addr_len == 0 || memcmp(msg->msg_name, addr, addr_len) == 0);
+}
+#endif
+
+/*
+ * Queues a datagram, the data must stay valid until udp_flush_sendq().
+ * On a connected socket addr may be NULL, with an addr_len of 0.
+ * Returns -1 if it could not be sent right away, 0 otherwise.
+ */
+static int
+udp_sendto(udp_sendq_t *sendq, int fd, const void *data, size_t len,
+           const struct sockaddr *addr, socklen_t addr_len)
+{
+#ifdef USE_MMSG
+    if (sendq->num > 0 && sendq->fd != fd) {
+        udp_flush_sendq(sendq);
+    }
+
+    int j = sendq->iovcnt++;
+    sendq->iov[j].iov_base = (void *)data;
+    sendq->iov[j].iov_len  = len;
+
+#ifdef USE_UDP_OFFLOAD
+    if (udp_can_coalesce(sendq, fd, len, addr, addr_len)) {
+        sendq->msgs[sendq->num - 1].msg_hdr.msg_iovlen++;
+    } else
+#endif
+    {
+        int i = sendq->num++;
+        sendq->fd = fd;
+        if (addr_len > 0) {
+            memcpy(&sendq->addr[i], addr, addr_len);
+        }
+        sendq->msgs[i].msg_hdr.msg_namelen = addr_len;
+        sendq->msgs[i].msg_hdr.msg_iov     = &sendq->iov[j];
+        sendq->msgs[i].msg_hdr.msg_iovlen  = 1;
+    }
+
+    if (sendq->iovcnt == UDP_BATCH_SIZE) {
+        udp_flush_sendq(sendq);
+    }
+    return 0;
+#else
+    return sendto(fd, data, len, 0, addr, addr_len) == -1 ? -1 : 0;
+#endif
+}
+
 static int
 setnonblocking(int fd)
 {
@@ -179,20 +557,6 @@ get_dstaddr(struct msghdr *msg, struct sockaddr_storage *dstaddr)
 
 #endif
 
-#define HASH_KEY_LEN sizeof(struct sockaddr_storage) + sizeof(int)
-static char *
-hash_key(const int af, const struct sockaddr_storage *addr)
-{
-    size_t addr_len = sizeof(struct sockaddr_storage);
-    static char key[HASH_KEY_LEN];
-
-    memset(key, 0, HASH_KEY_LEN);
-    memcpy(key, &af, sizeof(int));
-    memcpy(key + sizeof(int), (const uint8_t *)addr, addr_len);
-
-    return key;
-}
-
 #if defined(MODULE_REDIR) || defined(MODULE_REMOTE)
 static int
 construct_udprelay_header(const struct sockaddr_storage *in_addr,
@@ -223,6 +587,32 @@ construct_udprelay_header(const struct sockaddr_storage *in_addr,
 
 #endif
 
+/*
+ * Tells if a name can be an IP address at all, so that the names of most
+ * hosts are not copied and handed to cork_ip_init() for nothing.
+ */
+static int
+is_ip_literal(const char *name, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        char c = name[i];
+        if (!(c >= '0' && c <= '9') && !(c >= 'a' && c <= 'f')
+            && !(c >= 'A' && c <= 'F') && c != '.' && c != ':') {
+            return 0;
+        }
+    }
+
+    return len > 0;
+}
+
+/*
+ * Parses the address header at the start of buf and returns its length,
+ * or 0 if it is invalid. host and port get the address as text and may be
+ * NULL, they are only needed for logs and name queries. storage gets the
+ * address in binary form, unless it is a name to resolve.
+ */
 static int
 parse_udprelay_header(const char *buf, const size_t buf_len,
                       char *host, char *port, struct sockaddr_storage *storage)
@@ -251,7 +641,7 @@ parse_udprelay_header(const char *buf, const size_t buf_len,
         // Domain name
         uint8_t name_len = *(uint8_t *)(buf + offset);
         if (name_len + 4 <= buf_len) {
-            if (storage != NULL) {
+            if (storage != NULL && is_ip_literal(buf + offset + 1, name_len)) {
                 char tmp[257] = { 0 };
                 struct cork_ip ip;
                 memcpy(tmp, buf + offset + 1, name_len);
@@ -263,7 +653,7 @@ parse_udprelay_header(const char *buf, const size_t buf_len,
                         addr->sin_family = AF_INET;
                     } else if (ip.version == 6) {
                         struct sockaddr_in6 *addr = (struct sockaddr_in6 *)storage;
-                        ares_inet_pton(AF_INET, tmp, &(addr->sin6_addr));
+                        ares_inet_pton(AF_INET6, tmp, &(addr->sin6_addr));
                         addr->sin6_port   = *(uint16_t *)(buf + offset + 1 + name_len);
                         addr->sin6_family = AF_INET6;
                     }
@@ -271,6 +661,7 @@ parse_udprelay_header(const char *buf, const size_t buf_len,
             }
             if (host != NULL) {
                 memcpy(host, buf + offset + 1, name_len);
+                host[name_len] = '\0';
             }
             offset += 1 + name_len;
         }
@@ -404,6 +795,9 @@ create_remote_socket(int ipv6)
         }
 #endif
     }
+#ifdef USE_UDP_OFFLOAD
+    set_udp_offload(remote_sock);
+#endif
     return remote_sock;
 }
 
@@ -508,6 +902,12 @@ create_server_socket(const char *host, const char *port)
 
     freeaddrinfo(result);
 
+#ifdef USE_UDP_OFFLOAD
+    if (server_sock != -1) {
+        set_udp_offload(server_sock);
+    }
+#endif
+
     return server_sock;
 }
 
@@ -519,11 +919,8 @@ new_remote(int fd, server_ctx_t *server_ctx)
 
     ctx->fd         = fd;
     ctx->server_ctx = server_ctx;
-    ctx->af         = AF_UNSPEC;
 
     ev_io_init(&ctx->io, remote_recv_cb, fd, EV_READ);
-    ev_timer_init(&ctx->watcher, remote_timeout_cb, server_ctx->timeout,
-                  server_ctx->timeout);
 
     return ctx;
 }
@@ -572,27 +969,292 @@ void
 close_and_free_remote(EV_P_ remote_ctx_t *ctx)
 {
     if (ctx != NULL) {
-        ev_timer_stop(EV_A_ & ctx->watcher);
-        ev_io_stop(EV_A_ & ctx->io);
-        close(ctx->fd);
+        // don't leave queued packets on a closed socket
+        server_ctx_t *server_ctx = ctx->server_ctx;
+        if (server_ctx != NULL && server_ctx->sendq.num > 0
+            && server_ctx->sendq.fd == ctx->fd) {
+            udp_flush_sendq(&server_ctx->sendq);
+        }
+#ifdef MODULE_REMOTE
+        if (ctx->pool != NULL) {
+            nat_key_t peer;
+            nat_key_init(&peer, ctx->pool->index, &ctx->pool_addr);
+            nat_remove(server_ctx->pool_peers, &peer);
+        }
+#endif
+        if (ctx->fd != -1) {
+            ev_io_stop(EV_A_ & ctx->io);
+            close(ctx->fd);
+        }
         ss_free(ctx);
     }
 }
 
+/*
+ * The conn table maps the source address of a client to its remote, and
+ * the remotes of a server are also kept on a list, from the least to the
+ * most recently used. The oldest one goes first when the table is full,
+ * and as a remote is moved to the tail whenever it is used, the list is
+ * also in the order the remotes time out: a single timer for the head
+ * replaces a timer per remote.
+ */
+static void
+touch_remote(EV_P_ remote_ctx_t *remote_ctx)
+{
+    server_ctx_t *server_ctx = remote_ctx->server_ctx;
+
+    remote_ctx->last_used = ev_now(EV_A);
+    cork_dllist_remove(&remote_ctx->entries);
+    cork_dllist_add(&server_ctx->conns, &remote_ctx->entries);
+#ifdef MODULE_REMOTE
+    if (remote_ctx->fd != -1) {
+        cork_dllist_remove(&remote_ctx->fd_entries);
+        cork_dllist_add(&server_ctx->fd_conns, &remote_ctx->fd_entries);
+    }
+#endif
+}
+
 static void
-remote_timeout_cb(EV_P_ ev_timer *watcher, int revents)
+schedule_expire(EV_P_ server_ctx_t *server_ctx)
 {
-    remote_ctx_t *remote_ctx
-        = cork_container_of(watcher, remote_ctx_t, watcher);
+    struct cork_dllist_item *head = cork_dllist_head(&server_ctx->conns);
+
+    if (head == NULL || ev_is_active(&server_ctx->expire_watcher)) {
+        return;
+    }
+
+    remote_ctx_t *remote_ctx = cork_container_of(head, remote_ctx_t, entries);
+    ev_tstamp after          = remote_ctx->last_used + server_ctx->timeout - ev_now(EV_A);
+    ev_timer_set(&server_ctx->expire_watcher, max(after, 0.), 0.);
+    ev_timer_start(EV_A_ & server_ctx->expire_watcher);
+}
+
+static remote_ctx_t *
+lookup_remote(EV_P_ server_ctx_t *server_ctx, const nat_key_t *key)
+{
+    remote_ctx_t *remote_ctx = nat_lookup(server_ctx->conn_table, key);
+
+    if (remote_ctx != NULL) {
+        touch_remote(EV_A_ remote_ctx);
+    }
+
+    return remote_ctx;
+}
+
+static void
+remove_remote(EV_P_ remote_ctx_t *remote_ctx)
+{
+    nat_remove(remote_ctx->server_ctx->conn_table, &remote_ctx->key);
+    cork_dllist_remove(&remote_ctx->entries);
+#ifdef MODULE_REMOTE
+    if (remote_ctx->fd != -1) {
+        cork_dllist_remove(&remote_ctx->fd_entries);
+        remote_ctx->server_ctx->fd_conn_num--;
+    }
+#endif
 
     if (verbose) {
-        LOGI("[udp] connection timeout");
+        LOGI("[udp] one connection freed");
+    }
+
+    close_and_free_remote(EV_A_ remote_ctx);
+}
+
+#ifdef MODULE_REMOTE
+/*
+ * Remotes on pool sockets let the conn table grow far beyond the number of
+ * fds a process may have, so the remotes of the table with a socket of
+ * their own are also kept on a list of their own and held to
+ * MAX_UDP_CONN_NUM, the least recently used one going first.
+ */
+static void
+add_fd_remote(EV_P_ server_ctx_t *server_ctx, remote_ctx_t *remote_ctx)
+{
+    if (server_ctx->fd_conn_num >= MAX_UDP_CONN_NUM) {
+        struct cork_dllist_item *head = cork_dllist_head(&server_ctx->fd_conns);
+        remove_remote(EV_A_ cork_container_of(head, remote_ctx_t, fd_entries));
+    }
+    cork_dllist_add(&server_ctx->fd_conns, &remote_ctx->fd_entries);
+    server_ctx->fd_conn_num++;
+}
+#endif
+
+static void
+insert_remote(EV_P_ server_ctx_t *server_ctx, remote_ctx_t *remote_ctx,
+              const nat_key_t *key)
+{
+    remote_ctx_t *old = nat_lookup(server_ctx->conn_table, key);
+
+    if (old != NULL) {
+        remove_remote(EV_A_ old);
+    } else if (server_ctx->conn_table->count >= server_ctx->conn_table->max_entries) {
+        struct cork_dllist_item *head = cork_dllist_head(&server_ctx->conns);
+        remove_remote(EV_A_ cork_container_of(head, remote_ctx_t, entries));
+    }
+
+#ifdef MODULE_REMOTE
+    if (remote_ctx->fd != -1) {
+        add_fd_remote(EV_A_ server_ctx, remote_ctx);
+    }
+#endif
+
+    remote_ctx->key       = *key;
+    remote_ctx->last_used = ev_now(EV_A);
+    nat_insert(server_ctx->conn_table, key, remote_ctx);
+    cork_dllist_add(&server_ctx->conns, &remote_ctx->entries);
+
+    schedule_expire(EV_A_ server_ctx);
+}
+
+static void
+remote_expire_cb(EV_P_ ev_timer *watcher, int revents)
+{
+    server_ctx_t *server_ctx
+        = cork_container_of(watcher, server_ctx_t, expire_watcher);
+    struct cork_dllist_item *curr, *next;
+    ev_tstamp now = ev_now(EV_A);
+
+    cork_dllist_foreach_void(&server_ctx->conns, curr, next) {
+        remote_ctx_t *remote_ctx = cork_container_of(curr, remote_ctx_t, entries);
+        if (now - remote_ctx->last_used < server_ctx->timeout) {
+            break;
+        }
+
+        if (verbose) {
+            LOGI("[udp] connection timeout");
+        }
+
+        remove_remote(EV_A_ remote_ctx);
+    }
+
+    schedule_expire(EV_A_ server_ctx);
+}
+
+#ifdef MODULE_REMOTE
+static int
+open_remote_socket(server_ctx_t *server_ctx, int ipv6)
+{
+    int remotefd = create_remote_socket(ipv6);
+    if (remotefd == -1) {
+        return -1;
     }
 
-    char *key = hash_key(remote_ctx->af, &remote_ctx->src_addr);
-    cache_remove(remote_ctx->server_ctx->conn_cache, key, HASH_KEY_LEN);
+    setnonblocking(remotefd);
+#ifdef SO_BROADCAST
+    set_broadcast(remotefd);
+#endif
+#ifdef SO_NOSIGPIPE
+    set_nosigpipe(remotefd);
+#endif
+#ifdef IP_TOS
+    // Set QoS flag
+    int tos = 46;
+    setsockopt(remotefd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
+#endif
+#ifdef SET_INTERFACE
+    if (server_ctx->iface) {
+        if (setinterface(remotefd, server_ctx->iface) == -1)
+            ERROR("setinterface");
+    }
+#endif
+
+    return remotefd;
 }
 
+/*
+ * Creates a remote on a pool socket that does not talk to dst_addr yet.
+ * Returns NULL if there is none, the caller then opens a socket of its own.
+ */
+static remote_ctx_t *
+new_pooled_remote(server_ctx_t *server_ctx, const struct sockaddr_storage *dst_addr)
+{
+    int i;
+
+    for (i = 0; i < server_ctx->pool_num; i++) {
+        udp_pool_sock_t *sock = &server_ctx->pool[server_ctx->pool_next++ % server_ctx->pool_num];
+        nat_key_t peer;
+
+        if (sock->af != dst_addr->ss_family) {
+            continue;
+        }
+
+        nat_key_init(&peer, sock->index, dst_addr);
+        if (nat_lookup(server_ctx->pool_peers, &peer) != NULL) {
+            continue;
+        }
+
+        remote_ctx_t *remote_ctx = new_remote(-1, server_ctx);
+        if (nat_insert(server_ctx->pool_peers, &peer, remote_ctx) != 0) {
+            ss_free(remote_ctx);
+            return NULL;
+        }
+        remote_ctx->pool      = sock;
+        remote_ctx->pool_addr = *dst_addr;
+        // every reply on the pool socket comes from pool_addr
+        remote_ctx->peer_header_len = construct_udprelay_header(dst_addr,
+                                                                remote_ctx->peer_header);
+        return remote_ctx;
+    }
+
+    return NULL;
+}
+
+/*
+ * Returns the socket a remote sends to dst_addr from: the pool socket for
+ * the address it was created for, or else a socket of its own, opened the
+ * first time it is needed. Returns -1 on error.
+ */
+static int
+remote_send_fd(EV_P_ remote_ctx_t *remote_ctx, const struct sockaddr_storage *dst_addr)
+{
+    if (remote_ctx->pool != NULL
+        && sockaddr_cmp((struct sockaddr_storage *)dst_addr, &remote_ctx->pool_addr,
+                        sizeof(struct sockaddr_storage)) == 0) {
+        return remote_ctx->pool->fd;
+    }
+
+    if (remote_ctx->fd == -1) {
+        int remotefd = open_remote_socket(remote_ctx->server_ctx,
+                                          dst_addr->ss_family == AF_INET6);
+        if (remotefd == -1) {
+            ERROR("[udp] bind() error");
+            return -1;
+        }
+        remote_ctx->fd = remotefd;
+        ev_io_set(&remote_ctx->io, remotefd, EV_READ);
+        // a new remote starts its io once added to the conn table
+        if (remote_ctx->pool != NULL) {
+            add_fd_remote(EV_A_ remote_ctx->server_ctx, remote_ctx);
+            ev_io_start(EV_A_ & remote_ctx->io);
+        }
+    }
+
+    return remote_ctx->fd;
+}
+
+/*
+ * Follows the destination of a remote. The header of the replies of
+ * dst_addr is built on the first one and kept until the remote sends
+ * somewhere else. The socket is never connected to dst_addr: that would
+ * drop the replies of every other peer, and disconnecting it again on Linux
+ * would lose its source port and the interface it is bound to.
+ */
+static void
+remote_follow(remote_ctx_t *remote_ctx, const struct sockaddr_storage *dst_addr)
+{
+    if (sockaddr_cmp((struct sockaddr_storage *)dst_addr, &remote_ctx->dst_addr,
+                     sizeof(struct sockaddr_storage)) == 0) {
+        return;
+    }
+
+    memcpy(&remote_ctx->dst_addr, dst_addr, sizeof(struct sockaddr_storage));
+    // a pooled remote keeps the header of its pool address
+    if (remote_ctx->pool == NULL) {
+        remote_ctx->peer_header_len = 0;
+    }
+}
+#endif
+
 #ifdef MODULE_REMOTE
 static void
 resolv_free_cb(void *data)
@@ -616,56 +1278,49 @@ resolv_cb(struct sockaddr *addr, void *data)
     } else {
         remote_ctx_t *remote_ctx = query_ctx->remote_ctx;
         int cache_hit            = 0;
+        nat_key_t key;
+
+        nat_key_init(&key, AF_UNSPEC, &query_ctx->src_addr);
 
-        // Lookup in the conn cache
+        // Lookup in the conn table
         if (remote_ctx == NULL) {
-            char *key = hash_key(AF_UNSPEC, &query_ctx->src_addr);
-            cache_lookup(query_ctx->server_ctx->conn_cache, key, HASH_KEY_LEN, (void *)&remote_ctx);
+            remote_ctx = lookup_remote(EV_A_ query_ctx->server_ctx, &key);
         }
 
+        struct sockaddr_storage dst_addr;
+        memset(&dst_addr, 0, sizeof(struct sockaddr_storage));
+        memcpy(&dst_addr, addr, get_sockaddr_len(addr));
+
         if (remote_ctx == NULL) {
-            int remotefd = create_remote_socket(addr->sa_family == AF_INET6);
-            if (remotefd != -1) {
-                setnonblocking(remotefd);
-#ifdef SO_BROADCAST
-                set_broadcast(remotefd);
-#endif
-#ifdef SO_NOSIGPIPE
-                set_nosigpipe(remotefd);
-#endif
-#ifdef IP_TOS
-                // Set QoS flag
-                int tos = 46;
-                setsockopt(remotefd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
-#endif
-#ifdef SET_INTERFACE
-                if (query_ctx->server_ctx->iface) {
-                    if (setinterface(remotefd, query_ctx->server_ctx->iface) == -1)
-                        ERROR("setinterface");
+            if (query_ctx->server_ctx->pool_num > 0) {
+                remote_ctx = new_pooled_remote(query_ctx->server_ctx, &dst_addr);
+            }
+            if (remote_ctx == NULL) {
+                int remotefd = open_remote_socket(query_ctx->server_ctx,
+                                                  addr->sa_family == AF_INET6);
+                if (remotefd != -1) {
+                    remote_ctx = new_remote(remotefd, query_ctx->server_ctx);
+                } else {
+                    ERROR("[udp] bind() error");
                 }
-#endif
-                remote_ctx                  = new_remote(remotefd, query_ctx->server_ctx);
-                remote_ctx->src_addr        = query_ctx->src_addr;
-                remote_ctx->server_ctx      = query_ctx->server_ctx;
-                remote_ctx->addr_header_len = query_ctx->addr_header_len;
-                memcpy(remote_ctx->addr_header, query_ctx->addr_header,
-                       query_ctx->addr_header_len);
-            } else {
-                ERROR("[udp] bind() error");
+            }
+            if (remote_ctx != NULL) {
+                remote_ctx->src_addr = query_ctx->src_addr;
             }
         } else {
             cache_hit = 1;
         }
 
         if (remote_ctx != NULL) {
-            if (addr->sa_family == AF_INET)
-                memcpy(&remote_ctx->dst_addr, addr, sizeof(struct sockaddr_in));
-            else
-                memcpy(&remote_ctx->dst_addr, addr, sizeof(struct sockaddr_in6));
+            remote_follow(remote_ctx, &dst_addr);
 
             size_t addr_len = get_sockaddr_len(addr);
-            int s           = sendto(remote_ctx->fd, query_ctx->buf->data, query_ctx->buf->len,
-                                     0, addr, addr_len);
+            int remotefd    = remote_send_fd(EV_A_ remote_ctx, &dst_addr);
+            int s           = -1;
+            if (remotefd != -1) {
+                s = sendto(remotefd, query_ctx->buf->data, query_ctx->buf->len,
+                           0, addr, addr_len);
+            }
 
             if (s == -1) {
                 ERROR("[udp] sendto_remote");
@@ -673,12 +1328,18 @@ resolv_cb(struct sockaddr *addr, void *data)
                     close_and_free_remote(EV_A_ remote_ctx);
                 }
             } else {
+                // Later packets to the same name reuse its address
+                remote_ctx->addr_header_len = query_ctx->addr_header_len;
+                memcpy(remote_ctx->addr_header, query_ctx->addr_header,
+                       query_ctx->addr_header_len);
+                memcpy(&remote_ctx->name_addr, &dst_addr, sizeof(struct sockaddr_storage));
+
                 if (!cache_hit) {
-                    // Add to conn cache
-                    char *key = hash_key(AF_UNSPEC, &remote_ctx->src_addr);
-                    cache_insert(query_ctx->server_ctx->conn_cache, key, HASH_KEY_LEN, (void *)remote_ctx);
-                    ev_io_start(EV_A_ & remote_ctx->io);
-                    ev_timer_start(EV_A_ & remote_ctx->watcher);
+                    // Add to conn table
+                    insert_remote(EV_A_ query_ctx->server_ctx, remote_ctx, &key);
+                    if (remote_ctx->fd != -1) {
+                        ev_io_start(EV_A_ & remote_ctx->io);
+                    }
                 }
             }
         }
@@ -687,51 +1348,30 @@ resolv_cb(struct sockaddr *addr, void *data)
 
 #endif
 
+/*
+ * from_peer is set when the packet is known to come from the address the
+ * remote keeps the reply header of, so the header is built only once.
+ */
 static void
-remote_recv_cb(EV_P_ ev_io *w, int revents)
+remote_recv_packet(EV_P_ remote_ctx_t *remote_ctx, buffer_t *buf, struct msghdr *msg,
+                   int from_peer)
 {
-    ssize_t r;
-    remote_ctx_t *remote_ctx = (remote_ctx_t *)w;
     server_ctx_t *server_ctx = remote_ctx->server_ctx;
 
-    // server has been closed
-    if (server_ctx == NULL) {
-        LOGE("[udp] invalid server");
-        close_and_free_remote(EV_A_ remote_ctx);
-        return;
-    }
-
     if (verbose) {
         LOGI("[udp] remote receive a packet");
     }
 
-    struct sockaddr_storage src_addr;
-    socklen_t src_addr_len = sizeof(struct sockaddr_storage);
-    memset(&src_addr, 0, src_addr_len);
-
-    buffer_t *buf = ss_malloc(sizeof(buffer_t));
-    balloc(buf, buf_size);
-
-    // recv
-    r = recvfrom(remote_ctx->fd, buf->data, buf_size, 0, (struct sockaddr *)&src_addr, &src_addr_len);
-
-    if (r == -1) {
-        // error on recv
-        // simply drop that packet
-        ERROR("[udp] remote_recv_recvfrom");
-        goto CLEAN_UP;
-    } else if (r > packet_size) {
+    if (buf->len > packet_size) {
         LOGE("[udp] remote_recv_recvfrom fragmentation");
-        goto CLEAN_UP;
+        return;
     }
 
-    buf->len = r;
-
 #ifdef MODULE_LOCAL
     int err = server_ctx->crypto->decrypt_all(buf, server_ctx->crypto->cipher, buf_size);
     if (err) {
         // drop the packet silently
-        goto CLEAN_UP;
+        return;
     }
 
 #ifdef MODULE_REDIR
@@ -741,7 +1381,7 @@ remote_recv_cb(EV_P_ ev_io *w, int revents)
 
     if (dst_addr.ss_family != AF_INET && dst_addr.ss_family != AF_INET6) {
         LOGI("[udp] ss-redir does not support domain name");
-        goto CLEAN_UP;
+        return;
     }
 #else
     int len = parse_udprelay_header(buf->data, buf->len, NULL, NULL, NULL);
@@ -750,7 +1390,7 @@ remote_recv_cb(EV_P_ ev_io *w, int revents)
     if (len == 0) {
         // error when parsing header
         LOGE("[udp] error in parse header");
-        goto CLEAN_UP;
+        return;
     }
 
 #if defined(MODULE_TUNNEL) || defined(MODULE_REDIR)
@@ -776,8 +1416,16 @@ remote_recv_cb(EV_P_ ev_io *w, int revents)
     rx += buf->len;
 
     // Reconstruct UDP response header
-    char addr_header[512];
-    int addr_header_len = construct_udprelay_header(&src_addr, addr_header);
+    char buf_header[512];
+    char *addr_header   = remote_ctx->peer_header;
+    int addr_header_len = remote_ctx->peer_header_len;
+    if (!from_peer) {
+        addr_header     = buf_header;
+        addr_header_len = construct_udprelay_header(msg->msg_name, addr_header);
+    } else if (addr_header_len == 0) {
+        addr_header_len = construct_udprelay_header(msg->msg_name, addr_header);
+        remote_ctx->peer_header_len = addr_header_len;
+    }
 
     // Construct packet
     brealloc(buf, buf->len + addr_header_len, buf_size);
@@ -788,14 +1436,14 @@ remote_recv_cb(EV_P_ ev_io *w, int revents)
     int err = server_ctx->crypto->encrypt_all(buf, server_ctx->crypto->cipher, buf_size);
     if (err) {
         // drop the packet silently
-        goto CLEAN_UP;
+        return;
     }
 
 #endif
 
     if (buf->len > packet_size) {
         LOGE("[udp] remote_recv_sendto fragmentation");
-        goto CLEAN_UP;
+        return;
     }
 
     size_t remote_src_addr_len = get_sockaddr_len((struct sockaddr *)&remote_ctx->src_addr);
@@ -807,18 +1455,18 @@ remote_recv_cb(EV_P_ ev_io *w, int revents)
     int src_fd = socket(remote_ctx->src_addr.ss_family, SOCK_DGRAM, 0);
     if (src_fd < 0) {
         ERROR("[udp] remote_recv_socket");
-        goto CLEAN_UP;
+        return;
     }
     int opt = 1;
     if (setsockopt(src_fd, SOL_IP, IP_TRANSPARENT, &opt, sizeof(opt))) {
         ERROR("[udp] remote_recv_setsockopt");
         close(src_fd);
-        goto CLEAN_UP;
+        return;
     }
     if (setsockopt(src_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
         ERROR("[udp] remote_recv_setsockopt");
         close(src_fd);
-        goto CLEAN_UP;
+        return;
     }
 #ifdef IP_TOS
     // Set QoS flag
@@ -828,7 +1476,7 @@ remote_recv_cb(EV_P_ ev_io *w, int revents)
     if (bind(src_fd, (struct sockaddr *)&dst_addr, remote_dst_addr_len) != 0) {
         ERROR("[udp] remote_recv_bind");
         close(src_fd);
-        goto CLEAN_UP;
+        return;
     }
 
     int s = sendto(src_fd, buf->data, buf->len, 0,
@@ -836,93 +1484,187 @@ remote_recv_cb(EV_P_ ev_io *w, int revents)
     if (s == -1) {
         ERROR("[udp] remote_recv_sendto");
         close(src_fd);
-        goto CLEAN_UP;
+        return;
     }
     close(src_fd);
 
 #else
 
-    int s = sendto(server_ctx->fd, buf->data, buf->len, 0,
-                   (struct sockaddr *)&remote_ctx->src_addr, remote_src_addr_len);
+    int s = udp_sendto(&server_ctx->sendq, server_ctx->fd, buf->data, buf->len,
+                       (struct sockaddr *)&remote_ctx->src_addr, remote_src_addr_len);
     if (s == -1) {
         ERROR("[udp] remote_recv_sendto");
-        goto CLEAN_UP;
+        return;
     }
 
 #endif
 
     // handle the UDP packet successfully,
-    // triger the timer
-    ev_timer_again(EV_A_ & remote_ctx->watcher);
+    // restart its timeout
+    touch_remote(EV_A_ remote_ctx);
+}
+
+static void
+remote_recv_cb(EV_P_ ev_io *w, int revents)
+{
+    remote_ctx_t *remote_ctx = (remote_ctx_t *)w;
+    server_ctx_t *server_ctx = remote_ctx->server_ctx;
+    udp_batch_t *batch;
+    int i, n;
 
-CLEAN_UP:
+    // server has been closed
+    if (server_ctx == NULL) {
+        LOGE("[udp] invalid server");
+        close_and_free_remote(EV_A_ remote_ctx);
+        return;
+    }
+
+    batch = &server_ctx->batch;
+    do {
+        n = udp_recv_batch(batch, remote_ctx->fd);
+        if (n == -1) {
+            // error on recv
+            // simply drop that packet
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                ERROR("[udp] remote_recv_recvfrom");
+            return;
+        }
 
-    bfree(buf);
-    ss_free(buf);
+        for (i = 0; i < n; i++) {
+            struct msghdr *msg = &batch->msgs[i].msg_hdr;
+#ifdef MODULE_REMOTE
+            // the socket is not connected, replies may come from anyone
+            int from_peer = remote_ctx->pool == NULL
+                            && sockaddr_cmp((struct sockaddr_storage *)msg->msg_name,
+                                            &remote_ctx->dst_addr,
+                                            sizeof(struct sockaddr_storage)) == 0;
+#else
+            int from_peer = remote_ctx->connected;
+#endif
+            remote_recv_packet(EV_A_ remote_ctx, &batch->buf[i], msg, from_peer);
+        }
+
+        udp_flush_sendq(&server_ctx->sendq);
+    } while (udp_recv_pending(batch));
 }
 
+#ifdef MODULE_REMOTE
 static void
-server_recv_cb(EV_P_ ev_io *w, int revents)
+pool_recv_cb(EV_P_ ev_io *w, int revents)
 {
-    server_ctx_t *server_ctx = (server_ctx_t *)w;
-    struct sockaddr_storage src_addr;
-    memset(&src_addr, 0, sizeof(struct sockaddr_storage));
+    udp_pool_sock_t *sock    = (udp_pool_sock_t *)w;
+    server_ctx_t *server_ctx = sock->server_ctx;
+    udp_batch_t *batch       = &server_ctx->batch;
+    int i, n;
+
+    do {
+        n = udp_recv_batch(batch, sock->fd);
+        if (n == -1) {
+            // error on recv
+            // simply drop that packet
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                ERROR("[udp] pool_recv_recvfrom");
+            return;
+        }
 
-    buffer_t *buf = ss_malloc(sizeof(buffer_t));
-    balloc(buf, buf_size);
+        for (i = 0; i < n; i++) {
+            struct msghdr *msg = &batch->msgs[i].msg_hdr;
+            nat_key_t peer;
 
-    socklen_t src_addr_len = sizeof(struct sockaddr_storage);
-    unsigned int offset    = 0;
+            // Find the association this peer was sent to from this socket
+            nat_key_init(&peer, sock->index, (struct sockaddr_storage *)msg->msg_name);
+            remote_ctx_t *remote_ctx = nat_lookup(server_ctx->pool_peers, &peer);
+            if (remote_ctx == NULL) {
+                if (verbose) {
+                    LOGI("[udp] drop a packet from an unknown peer");
+                }
+                continue;
+            }
 
-#ifdef MODULE_REDIR
-    char control_buffer[64] = { 0 };
-    struct msghdr msg;
-    memset(&msg, 0, sizeof(struct msghdr));
-    struct iovec iov[1];
-    struct sockaddr_storage dst_addr;
-    memset(&dst_addr, 0, sizeof(struct sockaddr_storage));
+            remote_recv_packet(EV_A_ remote_ctx, &batch->buf[i], msg, 1);
+        }
 
-    msg.msg_name       = &src_addr;
-    msg.msg_namelen    = src_addr_len;
-    msg.msg_control    = control_buffer;
-    msg.msg_controllen = sizeof(control_buffer);
+        udp_flush_sendq(&server_ctx->sendq);
+    } while (udp_recv_pending(batch));
+}
 
-    iov[0].iov_base = buf->data;
-    iov[0].iov_len  = buf_size;
-    msg.msg_iov     = iov;
-    msg.msg_iovlen  = 1;
+/*
+ * Opens num unconnected sockets per family, shared by the remotes of a
+ * server. A remote talking to a single peer, the most common case by far,
+ * goes through one of them instead of a socket of its own.
+ */
+static void
+init_udp_pool(server_ctx_t *server_ctx, int num)
+{
+    int ipv6, i;
+
+    num                   = min(num, MAX_UDP_POOL_SIZE);
+    server_ctx->pool      = ss_malloc(sizeof(udp_pool_sock_t) * num * 2);
+    server_ctx->pool_num  = 0;
+    server_ctx->pool_next = 0;
 
-    buf->len = recvmsg(server_ctx->fd, &msg, 0);
-    if (buf->len == -1) {
-        ERROR("[udp] server_recvmsg");
-        goto CLEAN_UP;
-    } else if (buf->len > packet_size) {
-        ERROR("[udp] UDP server_recv_recvmsg fragmentation");
-        goto CLEAN_UP;
+    for (ipv6 = 0; ipv6 <= 1; ipv6++) {
+        for (i = 0; i < num; i++) {
+            int fd = open_remote_socket(server_ctx, ipv6);
+            if (fd == -1) {
+                break;
+            }
+
+            udp_pool_sock_t *sock = &server_ctx->pool[server_ctx->pool_num];
+            memset(sock, 0, sizeof(udp_pool_sock_t));
+            sock->fd         = fd;
+            sock->af         = ipv6 ? AF_INET6 : AF_INET;
+            sock->index      = server_ctx->pool_num++;
+            sock->server_ctx = server_ctx;
+            ev_io_init(&sock->io, pool_recv_cb, fd, EV_READ);
+            ev_io_start(server_ctx->loop, &sock->io);
+        }
     }
 
-    if (get_dstaddr(&msg, &dst_addr)) {
-        LOGE("[udp] unable to get dest addr");
-        goto CLEAN_UP;
+    if (nat_create(&server_ctx->pool_peers, MAX_UDP_POOL_CONN_NUM) != 0) {
+        FATAL("[udp] cannot create the pool table");
     }
 
-    src_addr_len = msg.msg_namelen;
-#else
-    ssize_t r;
-    r = recvfrom(server_ctx->fd, buf->data, buf_size,
-                 0, (struct sockaddr *)&src_addr, &src_addr_len);
-
-    if (r == -1) {
-        // error on recv
-        // simply drop that packet
-        ERROR("[udp] server_recv_recvfrom");
-        goto CLEAN_UP;
-    } else if (r > packet_size) {
+    LOGI("[udp] %d shared remote sockets", server_ctx->pool_num);
+}
+
+static void
+free_udp_pool(server_ctx_t *server_ctx)
+{
+    int i;
+
+    for (i = 0; i < server_ctx->pool_num; i++) {
+        ev_io_stop(server_ctx->loop, &server_ctx->pool[i].io);
+        close(server_ctx->pool[i].fd);
+    }
+    ss_free(server_ctx->pool);
+    if (server_ctx->pool_peers != NULL) {
+        nat_delete(server_ctx->pool_peers);
+    }
+}
+#endif
+
+static void
+server_recv_packet(EV_P_ server_ctx_t *server_ctx, buffer_t *buf, struct msghdr *msg)
+{
+    struct sockaddr_storage src_addr;
+    memcpy(&src_addr, msg->msg_name, sizeof(struct sockaddr_storage));
+
+    unsigned int offset = 0;
+
+    if (buf->len > packet_size) {
         ERROR("[udp] server_recv_recvfrom fragmentation");
-        goto CLEAN_UP;
+        return;
     }
 
-    buf->len = r;
+#ifdef MODULE_REDIR
+    struct sockaddr_storage dst_addr;
+    memset(&dst_addr, 0, sizeof(struct sockaddr_storage));
+
+    if (get_dstaddr(msg, &dst_addr)) {
+        LOGE("[udp] unable to get dest addr");
+        return;
+    }
 #endif
 
     if (verbose) {
@@ -935,7 +1677,7 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
     int err = server_ctx->crypto->decrypt_all(buf, server_ctx->crypto->cipher, buf_size);
     if (err) {
         // drop the packet silently
-        goto CLEAN_UP;
+        return;
     }
 #endif
 
@@ -999,7 +1741,7 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
 
     if (addr_header_len == 0) {
         LOGE("[udp] failed to parse tproxy addr");
-        goto CLEAN_UP;
+        return;
     }
 
     // reconstruct the buffer
@@ -1066,31 +1808,34 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
 
 #else
 
-    char host[257] = { 0 };
-    char port[64]  = { 0 };
+    // The text form of the address is only made for logs and queries
+    char host[257];
+    char port[64];
     struct sockaddr_storage dst_addr;
     memset(&dst_addr, 0, sizeof(struct sockaddr_storage));
 
     int addr_header_len = parse_udprelay_header(buf->data + offset, buf->len - offset,
-                                                host, port, &dst_addr);
+                                                NULL, NULL, &dst_addr);
     if (addr_header_len == 0) {
         // error in parse header
-        goto CLEAN_UP;
+        return;
     }
 
     char *addr_header = buf->data + offset;
+    if (verbose) {
+        parse_udprelay_header(addr_header, addr_header_len, host, port, NULL);
+    }
 #endif
 
+    nat_key_t key;
 #ifdef MODULE_LOCAL
-    char *key = hash_key(server_ctx->remote_addr->sa_family, &src_addr);
+    nat_key_init(&key, server_ctx->remote_addr->sa_family, &src_addr);
 #else
-    char *key = hash_key(dst_addr.ss_family, &src_addr);
+    nat_key_init(&key, dst_addr.ss_family, &src_addr);
 #endif
 
-    struct cache *conn_cache = server_ctx->conn_cache;
-
-    remote_ctx_t *remote_ctx = NULL;
-    cache_lookup(conn_cache, key, HASH_KEY_LEN, (void *)&remote_ctx);
+    // a hit also restarts the timeout
+    remote_ctx_t *remote_ctx = lookup_remote(EV_A_ server_ctx, &key);
 
     if (remote_ctx != NULL) {
         if (sockaddr_cmp(&src_addr, &remote_ctx->src_addr, sizeof(src_addr))) {
@@ -1098,11 +1843,6 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
         }
     }
 
-    // reset the timer
-    if (remote_ctx != NULL) {
-        ev_timer_again(EV_A_ & remote_ctx->watcher);
-    }
-
     if (remote_ctx == NULL) {
         if (verbose) {
 #ifdef MODULE_REDIR
@@ -1136,7 +1876,7 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
 #if !defined(MODULE_TUNNEL) && !defined(MODULE_REDIR)
     if (frag) {
         LOGE("[udp] drop a message since frag is not 0, but %d", frag);
-        goto CLEAN_UP;
+        return;
     }
 #endif
 
@@ -1148,7 +1888,7 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
         int remotefd = create_remote_socket(remote_addr->sa_family == AF_INET6);
         if (remotefd < 0) {
             ERROR("[udp] udprelay bind() error");
-            goto CLEAN_UP;
+            return;
         }
         setnonblocking(remotefd);
 
@@ -1172,22 +1912,28 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
             if (protect_socket(remotefd) == -1) {
                 ERROR("protect_socket");
                 close(remotefd);
-                goto CLEAN_UP;
+                return;
             }
         }
 #endif
 
+        // A remote only ever talks to the server
+        if (connect(remotefd, remote_addr, remote_addr_len) == -1) {
+            ERROR("[udp] connect");
+            close(remotefd);
+            return;
+        }
+
         // Init remote_ctx
         remote_ctx                  = new_remote(remotefd, server_ctx);
         remote_ctx->src_addr        = src_addr;
-        remote_ctx->af              = remote_addr->sa_family;
+        remote_ctx->connected       = 1;
 
-        // Add to conn cache
-        cache_insert(conn_cache, key, HASH_KEY_LEN, (void *)remote_ctx);
+        // Add to conn table
+        insert_remote(EV_A_ server_ctx, remote_ctx, &key);
 
         // Start remote io
         ev_io_start(EV_A_ & remote_ctx->io);
-        ev_timer_start(EV_A_ & remote_ctx->watcher);
     }
 
     remote_ctx->addr_header_len = addr_header_len;
@@ -1202,15 +1948,15 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
 
     if (err) {
         // drop the packet silently
-        goto CLEAN_UP;
+        return;
     }
 
     if (buf->len > packet_size) {
         LOGE("[udp] server_recv_sendto fragmentation");
-        goto CLEAN_UP;
+        return;
     }
 
-    int s = sendto(remote_ctx->fd, buf->data, buf->len, 0, remote_addr, remote_addr_len);
+    int s = udp_sendto(&server_ctx->sendq, remote_ctx->fd, buf->data, buf->len, NULL, 0);
 
     if (s == -1) {
         ERROR("[udp] server_recv_sendto");
@@ -1223,54 +1969,58 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
 
     if (buf->len - addr_header_len > packet_size) {
         LOGE("[udp] server_recv_sendto fragmentation");
-        goto CLEAN_UP;
+        return;
     }
 
     if (remote_ctx != NULL) {
         cache_hit = 1;
         if (dst_addr.ss_family != AF_INET && dst_addr.ss_family != AF_INET6) {
-            need_query = 1;
+            // the name the remote last resolved needs no new query
+            if (remote_ctx->name_addr.ss_family != AF_UNSPEC
+                && remote_ctx->addr_header_len == addr_header_len
+                && memcmp(remote_ctx->addr_header, addr_header, addr_header_len) == 0) {
+                memcpy(&dst_addr, &remote_ctx->name_addr, sizeof(struct sockaddr_storage));
+            } else {
+                need_query = 1;
+            }
         }
     } else {
         if (dst_addr.ss_family == AF_INET || dst_addr.ss_family == AF_INET6) {
-            int remotefd = create_remote_socket(dst_addr.ss_family == AF_INET6);
-            if (remotefd != -1) {
-                setnonblocking(remotefd);
-#ifdef SO_BROADCAST
-                set_broadcast(remotefd);
-#endif
-#ifdef SO_NOSIGPIPE
-                set_nosigpipe(remotefd);
-#endif
-#ifdef IP_TOS
-                // Set QoS flag
-                int tos = 46;
-                setsockopt(remotefd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
-#endif
-#ifdef SET_INTERFACE
-                if (server_ctx->iface) {
-                    if (setinterface(remotefd, server_ctx->iface) == -1)
-                        ERROR("setinterface");
+            if (server_ctx->pool_num > 0) {
+                remote_ctx = new_pooled_remote(server_ctx, &dst_addr);
+            }
+            if (remote_ctx == NULL) {
+                int remotefd = open_remote_socket(server_ctx, dst_addr.ss_family == AF_INET6);
+                if (remotefd == -1) {
+                    ERROR("[udp] bind() error");
+                    return;
                 }
-#endif
-                remote_ctx                  = new_remote(remotefd, server_ctx);
-                remote_ctx->src_addr        = src_addr;
-                remote_ctx->server_ctx      = server_ctx;
-                remote_ctx->addr_header_len = addr_header_len;
-                memcpy(remote_ctx->addr_header, addr_header, addr_header_len);
-                memcpy(&remote_ctx->dst_addr, &dst_addr, sizeof(struct sockaddr_storage));
-            } else {
-                ERROR("[udp] bind() error");
-                goto CLEAN_UP;
+                remote_ctx = new_remote(remotefd, server_ctx);
             }
+            remote_ctx->src_addr        = src_addr;
+            remote_ctx->addr_header_len = addr_header_len;
+            memcpy(remote_ctx->addr_header, addr_header, addr_header_len);
+            remote_follow(remote_ctx, &dst_addr);
         }
     }
 
     if (remote_ctx != NULL && !need_query) {
         size_t addr_len = get_sockaddr_len((struct sockaddr *)&dst_addr);
-        int s           = sendto(remote_ctx->fd, buf->data + addr_header_len,
-                                 buf->len - addr_header_len, 0,
-                                 (struct sockaddr *)&dst_addr, addr_len);
+        int remotefd    = remote_send_fd(EV_A_ remote_ctx, &dst_addr);
+        int s           = -1;
+        if (remotefd == -1) {
+            // already reported
+        } else if (cache_hit) {
+            remote_follow(remote_ctx, &dst_addr);
+            s = udp_sendto(&server_ctx->sendq, remotefd, buf->data + addr_header_len,
+                           buf->len - addr_header_len,
+                           (struct sockaddr *)&dst_addr, addr_len);
+        } else {
+            // a new remote is freed on error, so send its first packet now
+            s = sendto(remotefd, buf->data + addr_header_len,
+                       buf->len - addr_header_len, 0,
+                       (struct sockaddr *)&dst_addr, addr_len);
+        }
 
         if (s == -1) {
             ERROR("[udp] sendto_remote");
@@ -1279,13 +2029,11 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
             }
         } else {
             if (!cache_hit) {
-                // Add to conn cache
-                remote_ctx->af = dst_addr.ss_family;
-                char *key = hash_key(remote_ctx->af, &remote_ctx->src_addr);
-                cache_insert(server_ctx->conn_cache, key, HASH_KEY_LEN, (void *)remote_ctx);
-
-                ev_io_start(EV_A_ & remote_ctx->io);
-                ev_timer_start(EV_A_ & remote_ctx->watcher);
+                // Add to conn table
+                insert_remote(EV_A_ server_ctx, remote_ctx, &key);
+                if (remote_ctx->fd != -1) {
+                    ev_io_start(EV_A_ & remote_ctx->io);
+                }
             }
         }
     } else {
@@ -1306,25 +2054,38 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
             query_ctx->remote_ctx = remote_ctx;
         }
 
+        if (!verbose) {
+            parse_udprelay_header(addr_header, addr_header_len, host, port, NULL);
+        }
+
         resolv_start(host, htons(atoi(port)), resolv_cb, resolv_free_cb, query_ctx);
     }
 #endif
-
-CLEAN_UP:
-    bfree(buf);
-    ss_free(buf);
 }
 
-void
-free_cb(void *key, void *element)
+static void
+server_recv_cb(EV_P_ ev_io *w, int revents)
 {
-    remote_ctx_t *remote_ctx = (remote_ctx_t *)element;
+    server_ctx_t *server_ctx = (server_ctx_t *)w;
+    udp_batch_t *batch       = &server_ctx->batch;
+    int i, n;
+
+    do {
+        n = udp_recv_batch(batch, server_ctx->fd);
+        if (n == -1) {
+            // error on recv
+            // simply drop that packet
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                ERROR("[udp] server_recv_recvfrom");
+            return;
+        }
 
-    if (verbose) {
-        LOGI("[udp] one connection freed");
-    }
+        for (i = 0; i < n; i++) {
+            server_recv_packet(EV_A_ server_ctx, &batch->buf[i], &batch->msgs[i].msg_hdr);
+        }
 
-    close_and_free_remote(EV_DEFAULT, remote_ctx);
+        udp_flush_sendq(&server_ctx->sendq);
+    } while (udp_recv_pending(batch));
 }
 
 int
@@ -1335,7 +2096,7 @@ init_udprelay(const char *server_host, const char *server_port,
               const ss_addr_t tunnel_addr,
 #endif
 #endif
-              int mtu, crypto_t *crypto, int timeout, const char *iface)
+              int mtu, int offload, crypto_t *crypto, int timeout, const char *iface)
 {
     // Initialize ev loop
     struct ev_loop *loop = EV_DEFAULT;
@@ -1346,9 +2107,27 @@ init_udprelay(const char *server_host, const char *server_port,
         buf_size    = packet_size * 2;
     }
 
-    // Initialize cache
-    struct cache *conn_cache;
-    cache_create(&conn_cache, MAX_UDP_CONN_NUM, free_cb);
+    // Initialize GSO and GRO, turned off again if the kernel lacks them
+#ifdef USE_UDP_OFFLOAD
+    udp_gso = offload;
+    udp_gro = offload;
+#else
+    if (offload) {
+        LOGI("[udp] GSO and GRO are not supported");
+    }
+#endif
+
+    // Initialize conn table
+    nat_table_t *conn_table;
+    size_t max_conn_num = MAX_UDP_CONN_NUM;
+#ifdef MODULE_REMOTE
+    if (udp_pool > 0) {
+        max_conn_num = MAX_UDP_POOL_CONN_NUM;
+    }
+#endif
+    if (nat_create(&conn_table, max_conn_num) != 0) {
+        FATAL("[udp] cannot create the conn table");
+    }
 
     // ////////////////////////////////////////////////
     // Setup server context
@@ -1367,7 +2146,18 @@ init_udprelay(const char *server_host, const char *server_port,
     server_ctx->timeout    = max(timeout, MIN_UDP_TIMEOUT);
     server_ctx->crypto     = crypto;
     server_ctx->iface      = iface;
-    server_ctx->conn_cache = conn_cache;
+    server_ctx->conn_table = conn_table;
+    cork_dllist_init(&server_ctx->conns);
+#ifdef MODULE_REMOTE
+    cork_dllist_init(&server_ctx->fd_conns);
+#endif
+    ev_timer_init(&server_ctx->expire_watcher, remote_expire_cb, 0, 0);
+    init_udp_batch(&server_ctx->batch, &server_ctx->sendq);
+#ifdef MODULE_REMOTE
+    if (udp_pool > 0) {
+        init_udp_pool(server_ctx, udp_pool);
+    }
+#endif
 #ifdef MODULE_LOCAL
     server_ctx->remote_addr     = remote_addr;
     server_ctx->remote_addr_len = remote_addr_len;
@@ -1390,8 +2180,20 @@ free_udprelay()
     while (server_num-- > 0) {
         server_ctx_t *server_ctx = server_ctx_list[server_num];
         ev_io_stop(loop, &server_ctx->io);
+        ev_timer_stop(loop, &server_ctx->expire_watcher);
         close(server_ctx->fd);
-        cache_delete(server_ctx->conn_cache, 0);
+        struct cork_dllist_item *curr, *next;
+        cork_dllist_foreach_void(&server_ctx->conns, curr, next) {
+            remote_ctx_t *remote_ctx = cork_container_of(curr, remote_ctx_t, entries);
+            close_and_free_remote(loop, remote_ctx);
+        }
+        nat_delete(server_ctx->conn_table);
+#ifdef MODULE_REMOTE
+        if (server_ctx->pool != NULL) {
+            free_udp_pool(server_ctx);
+        }
+#endif
+        free_udp_batch(&server_ctx->batch);
         ss_free(server_ctx);
         server_ctx_list[server_num] = NULL;
     }
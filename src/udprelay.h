@@ -25,6 +25,7 @@
 
 #include <ev.h>
 #include <time.h>
+#include <libcork/ds.h>
 
 #include "crypto.h"
 #include "jconf.h"
@@ -33,7 +34,7 @@
 #include "resolv.h"
 #endif
 
-#include "cache.h"
+#include "nat.h"
 
 #include "common.h"
 
@@ -41,13 +42,117 @@
 
 #define DEFAULT_PACKET_SIZE 1397 // 1492 - 1 - 28 - 2 - 64 = 1397, the default MTU for UDP relay
 
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+#define USE_MMSG
+#endif
+
+#ifdef __linux__
+#include <netinet/udp.h>
+#endif
+
+/*
+ * UDP GSO sends a train of same size datagrams to one address with a single
+ * message, and UDP GRO hands such a train back the same way. Both need
+ * sendmmsg()/recvmmsg(), and redir, which reads the original destination of
+ * every datagram from its control message, does not use them.
+ */
+#if defined(USE_MMSG) && defined(UDP_SEGMENT) && defined(UDP_GRO) \
+    && !defined(MODULE_REDIR)
+#define USE_UDP_OFFLOAD
+#endif
+
+// The kernel coalesces at most this many segments
+#define UDP_MAX_SEGMENTS 64
+
+// GRO trains received per recvmmsg()
+#define UDP_GRO_TRAINS 8
+
+// Datagrams received per wakeup, and sent per sendmmsg()
+#ifdef USE_MMSG
+#ifdef USE_UDP_OFFLOAD
+#define UDP_BATCH_SIZE UDP_MAX_SEGMENTS
+#else
+#define UDP_BATCH_SIZE 32
+#endif
+typedef struct mmsghdr udp_msg_t;
+#else
+#define UDP_BATCH_SIZE 1
+typedef struct {
+    struct msghdr msg_hdr;
+    unsigned int msg_len;
+} udp_msg_t;
+#endif
+
+/*
+ * Packet buffers of a server context, allocated once and reused by every
+ * batch of datagrams received on the server socket or its remotes.
+ */
+typedef struct udp_batch {
+    buffer_t buf[UDP_BATCH_SIZE];
+    struct sockaddr_storage addr[UDP_BATCH_SIZE];
+    struct iovec iov[UDP_BATCH_SIZE];
+#ifdef MODULE_REDIR
+    char control[UDP_BATCH_SIZE][64];
+#endif
+    udp_msg_t msgs[UDP_BATCH_SIZE];
+#ifdef USE_UDP_OFFLOAD
+    // whole GRO trains, only allocated when GRO is on, split into buf
+    // UDP_BATCH_SIZE datagrams at a time
+    buffer_t gro[UDP_GRO_TRAINS];
+    struct sockaddr_storage gro_addr[UDP_GRO_TRAINS];
+    struct iovec gro_iov[UDP_GRO_TRAINS];
+    char gro_control[UDP_GRO_TRAINS][CMSG_SPACE(sizeof(int))];
+    udp_msg_t gro_msgs[UDP_GRO_TRAINS];
+    size_t gro_seg[UDP_GRO_TRAINS];
+    int gro_num;       // trains received
+    int gro_next;      // train being split
+    size_t gro_off;    // bytes of it already split
+#endif
+} udp_batch_t;
+
+/*
+ * Datagrams queued for one socket. With GSO, a datagram to the same address
+ * as the previous message joins it as one more segment, so a message can
+ * span several entries of iov.
+ */
+typedef struct udp_sendq {
+    int fd;
+    int num;          // messages
+    int iovcnt;       // datagrams
+    struct sockaddr_storage addr[UDP_BATCH_SIZE];
+    struct iovec iov[UDP_BATCH_SIZE];
+    udp_msg_t msgs[UDP_BATCH_SIZE];
+#ifdef USE_UDP_OFFLOAD
+    char control[UDP_BATCH_SIZE][CMSG_SPACE(sizeof(uint16_t))];
+#endif
+} udp_sendq_t;
+
+#ifdef MODULE_REMOTE
+/*
+ * A remote socket shared by many associations, see --udp-pool.
+ * Replies are matched to their association by the address they come from,
+ * so one address is used by at most one association on each socket.
+ */
+typedef struct udp_pool_sock {
+    ev_io io;
+    int fd;
+    int af;
+    int index;                  // position in the pool, part of the peer keys
+    struct server_ctx *server_ctx;
+} udp_pool_sock_t;
+#endif
+
 typedef struct server_ctx {
     ev_io io;
     int fd;
     crypto_t *crypto;
     int timeout;
     const char *iface;
-    struct cache *conn_cache;
+    nat_table_t *conn_table;
+    struct cork_dllist conns;   // remotes, least recently used first
+    ev_timer expire_watcher;    // fires when the first remote times out
+    udp_batch_t batch;
+    udp_sendq_t sendq;
 #ifdef MODULE_LOCAL
     const struct sockaddr *remote_addr;
     int remote_addr_len;
@@ -57,6 +162,12 @@ typedef struct server_ctx {
 #endif
 #ifdef MODULE_REMOTE
     struct ev_loop *loop;
+    int pool_num;
+    int pool_next;
+    udp_pool_sock_t *pool;
+    nat_table_t *pool_peers;    // pool socket and remote address -> remote_ctx
+    struct cork_dllist fd_conns; // remotes with a socket of their own, LRU first
+    int fd_conn_num;
 #endif
 } server_ctx_t;
 
@@ -73,16 +184,24 @@ typedef struct query_ctx {
 
 typedef struct remote_ctx {
     ev_io io;
-    ev_timer watcher;
-    int af;
-    int fd;
+    int fd;                     // -1 if the remote only uses a pool socket
+    int connected;              // fd is connected to a single peer
     int addr_header_len;
     char addr_header[384];
     struct sockaddr_storage src_addr;
 #ifdef MODULE_REMOTE
     struct sockaddr_storage dst_addr;
+    struct sockaddr_storage name_addr;  // address of the name in addr_header
+    udp_pool_sock_t *pool;      // the pool socket used to reach pool_addr
+    struct sockaddr_storage pool_addr;
+    int peer_header_len;        // 0 if not cached
+    char peer_header[32];       // header of the replies of the peer
+    struct cork_dllist_item fd_entries; // in fd_conns once in the conn table
 #endif
+    nat_key_t key;
+    ev_tstamp last_used;
     struct server_ctx *server_ctx;
+    struct cork_dllist_item entries;
 } remote_ctx_t;
 
 #endif // _UDPRELAY_H
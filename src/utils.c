@@ -358,12 +358,44 @@ usage()
     printf(
         "       [--manager-address <addr>] UNIX domain socket address.\n");
 #endif
+#ifdef MODULE_REMOTE
+    printf(
+        "       [--workers <num>]          Number of worker processes, each with\n");
+    printf(
+        "                                  its own event loop and SO_REUSEPORT sockets.\n");
+    printf(
+        "       [--replay-window <sec>]    How long salts are remembered to detect\n");
+    printf(
+        "                                  replay attacks, 3600 by default.\n");
+    printf(
+        "       [--replay-file <path>]     Keep the replay filter in this file so it\n");
+    printf(
+        "                                  survives restarts.\n");
+#endif
 #ifdef MODULE_MANAGER
     printf(
         "       [--executable <path>]      Path to the executable of ss-server.\n");
+#endif
+#if defined(MODULE_REMOTE) || defined(MODULE_LOCAL)
+    printf(
+        "       [--buffer-size <size>]     Size of the TCP relay buffer, in bytes.\n");
 #endif
     printf(
         "       [--mtu <MTU>]              MTU of your network interface.\n");
+#if defined(__linux__) && (defined(MODULE_REMOTE) || defined(MODULE_LOCAL)) \
+    && !defined(MODULE_REDIR)
+    printf(
+        "       [--udp-offload]            Enable UDP GSO and GRO for the UDP relay.\n");
+#endif
+#ifdef MODULE_REMOTE
+    printf(
+        "       [--udp-pool <num>]         Share <num> remote sockets per address family\n"
+        "                                  between UDP associations.\n");
+#endif
+#if defined(MODULE_REMOTE) || defined(MODULE_LOCAL)
+    printf(
+        "       [--bench-ciphers]          Print the speed of the AEAD ciphers and exit.\n");
+#endif
 #ifdef __linux__
     printf(
         "       [--mptcp]                  Enable Multipath TCP on MPTCP Kernel.\n");